@@ -0,0 +1,1112 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * Userspace model of the fair.c pick path, for trying scheduler policies
+ * in seconds instead of a kernel rebuild per experiment.
+ *
+ * Each CPU has a cfs_rq reduced to an array of runnable tasks. The EEVDF
+ * logic (avg_vruntime(), entity_eligible(), pick_eevdf(), place_entity(),
+ * update_curr(), update_deadline()) follows fair.c, and so do the two
+ * policies under test: Task1's entangled CPUs and Task2B's user penalty.
+ * Time advances in fixed steps; picks happen at step boundaries.
+ *
+ * The workload is either synthetic (uid:threads:run_us:sleep_us specs) or
+ * replayed from a recorded trace with -r: ftrace text with sched_switch and
+ * sched_wakeup events, or a CSV of the same events, e.g. from perf script.
+ * Each task's run/sleep pattern is rebuilt from the trace and played once.
+ */
+
+// Constants
+#define NICE_0_LOAD 1024
+#define TICK_NS 4000000ULL          // CONFIG_HZ=250, for the vlag clamp
+#define MAX_CPUS 256
+#define MAX_TASKS 8192
+#define MAX_USERS 1024
+#define PID_HASH_SIZE 16384        // power of two, > MAX_TASKS
+
+// Same table as sched_prio_to_weight[] in core.c
+static const unsigned long prio_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+// Data Structures
+typedef struct {
+    uint64_t run_ns;    // CPU time to consume before blocking
+    uint64_t sleep_ns;  // then sleep this long (0: stay runnable)
+} Burst;
+
+typedef struct {
+    int id;
+    unsigned int uid;
+    unsigned long weight;
+
+    // sched_entity
+    int64_t vruntime;
+    int64_t deadline;
+    int64_t vlag;
+    uint64_t slice;
+    int on_rq;
+    int cpu;
+
+    // What the task does
+    Burst *bursts;
+    int nr_bursts;
+    int cur_burst;
+    int loop;           // restart the bursts when done
+    int done;
+    uint64_t remaining;
+    uint64_t wake_at;   // when sleeping
+
+    // Results
+    uint64_t sum_exec;
+    uint64_t woken_at;  // pending wakeup, for the latency
+    int waiting;
+} Task;
+
+typedef struct {
+    Task **queue;       // runnable tasks, not counting curr
+    int nr_queued;
+    Task *curr;
+    int64_t zero_vruntime;
+    int need_resched;
+
+    // Entanglement state, as in Task1's fair.c
+    int group;          // -1 if not entangled
+    int forced;
+    uint64_t idle_start;
+    uint64_t forced_idle_ns;
+    uint64_t busy_ns;
+} CpuRq;
+
+typedef struct {
+    unsigned int uid;
+    int nr_tasks;
+    uint64_t exec_ns;
+
+    // user_util_update(): PELT-style decayed utilization, in CPUs
+    uint64_t period_ns; // run time in the current 1024us period
+    double util_sum;
+    double util;
+    double fair_scale;  // user_fair_refresh()'s penalty, 1.0 is none
+} UserRecord;
+
+// A task as seen in the trace, while its bursts are being rebuilt
+typedef struct {
+    int pid;
+    unsigned int uid;
+    int nice;
+    int state;          // TRACE_*
+    uint64_t first_ts;  // first runnable, if started
+    int started;
+    uint64_t run_start;
+    uint64_t run_acc;   // run time since the last block
+    uint64_t sleep_start;
+    Burst *bursts;
+    int nr_bursts;
+    int max_bursts;
+} TraceTask;
+
+enum { TRACE_UNKNOWN, TRACE_SLEEPING, TRACE_RUNNABLE, TRACE_RUNNING };
+
+// Global State
+CpuRq cpus[MAX_CPUS];
+int nr_cpus = 4;
+Task *tasks;
+int num_tasks = 0;
+UserRecord users[MAX_USERS];
+int num_users = 0;
+
+uint64_t sim_now = 0;
+uint64_t step_ns = 50000;               // 50us
+uint64_t duration_ns = 10000000000ULL;  // 10s
+uint64_t base_slice_ns = 3000000;       // sysctl_sched_base_slice
+
+// Policies
+int opt_entangle = 0;                   // Task1: pair CPUs 2k and 2k+1
+uint64_t entangle_timeout_ns = 10000000000ULL; // 0 means strict
+int entangle_pick_scan = 8;             // sysctl_entangled_pick_scan
+int opt_user_fair = 0;                  // Task2B phase 3
+double user_fair_max_scale = 8.0;       // sysctl_sched_user_fair_max_scale
+
+// Statistics
+unsigned long long nr_picks = 0;
+double pick_host_ns = 0.0;
+unsigned long long nr_wakeups = 0;
+uint64_t *wakeup_lats;                  // every wakeup latency, for percentiles
+size_t wakeup_lats_cap = 0;
+unsigned long long nr_conflicts = 0;
+unsigned long long nr_overrides = 0;
+
+// Trace replay
+const char *replay_file = NULL;
+const char *pidmap_file = NULL;
+int duration_given = 0;
+TraceTask *trace_tasks;
+int nr_trace_tasks = 0;
+int pid_hash[PID_HASH_SIZE];            // index + 1 into trace_tasks
+uint64_t trace_start = UINT64_MAX, trace_end = 0;
+
+// Prototypes
+void usage(const char *prog);
+int parse_task_spec(const char *spec);
+UserRecord *get_user(unsigned int uid);
+Task *new_task(unsigned int uid, int nice, Burst *bursts, int nr_bursts, int loop,
+               uint64_t start_ns);
+int load_trace(const char *path);
+int load_pidmap(const char *path);
+TraceTask *trace_task(int pid, int prio, uint64_t ts);
+void trace_switch_out(int pid, int prio, const char *state, uint64_t ts);
+void trace_switch_in(int pid, int prio, uint64_t ts);
+void trace_wakeup(int pid, int prio, uint64_t ts);
+int push_burst(TraceTask *t, uint64_t run_ns);
+int parse_ftrace_line(const char *line);
+int parse_csv_line(const char *line);
+int cmp_u64(const void *a, const void *b);
+void simulate(void);
+int64_t avg_vruntime(CpuRq *rq);
+int entity_eligible(CpuRq *rq, Task *se);
+Task *pick_eevdf(CpuRq *rq);
+void place_entity(CpuRq *rq, Task *se, int initial);
+void update_curr(CpuRq *rq, uint64_t delta_exec);
+int update_deadline(Task *se);
+void enqueue_task(CpuRq *rq, Task *p, int initial);
+void dequeue_task(CpuRq *rq, Task *p);
+void pick_next(int cpu);
+int entangled_conflict(int cpu, Task *p);
+Task *entangle_pick_compatible(CpuRq *rq, int cpu);
+int select_cpu(Task *p);
+void update_user_util(void);
+double user_fair_penalty(Task *p);
+void start_burst(Task *p);
+void note_wakeup_latency(Task *p);
+void print_results(void);
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    // 1. Parse Arguments
+    while ((opt = getopt(argc, argv, "c:t:q:s:Ee:Um:r:p:")) != -1) {
+        switch (opt) {
+        case 'c': nr_cpus = atoi(optarg); break;
+        case 't':
+            duration_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+            duration_given = 1;
+            break;
+        case 'q': step_ns = strtoull(optarg, NULL, 10) * 1000ULL; break;
+        case 's': base_slice_ns = strtoull(optarg, NULL, 10) * 1000ULL; break;
+        case 'E': opt_entangle = 1; break;
+        case 'e': entangle_timeout_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+        case 'U': opt_user_fair = 1; break;
+        case 'm': user_fair_max_scale = atof(optarg); break;
+        case 'r': replay_file = optarg; break;
+        case 'p': pidmap_file = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (nr_cpus <= 0 || nr_cpus > MAX_CPUS || !step_ns || !duration_ns ||
+        !base_slice_ns || user_fair_max_scale < 1.0 || user_fair_max_scale > 1024.0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    tasks = calloc(MAX_TASKS, sizeof(Task));
+    if (!tasks) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int i = 0; i < nr_cpus; i++) {
+        cpus[i].queue = calloc(MAX_TASKS, sizeof(Task *));
+        if (!cpus[i].queue) {
+            perror("calloc");
+            return 1;
+        }
+        cpus[i].group = opt_entangle && (i ^ 1) < nr_cpus ? i / 2 : -1;
+    }
+
+    // 2. Build the workload
+    if (replay_file) {
+        if (pidmap_file && !load_pidmap(pidmap_file))
+            return 1;
+        if (!load_trace(replay_file))
+            return 1;
+        if (!duration_given)
+            duration_ns = trace_end - trace_start + step_ns;
+    } else if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!parse_task_spec(argv[i])) {
+            fprintf(stderr, "Bad task spec: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // 3. Run and report
+    simulate();
+    print_results();
+    return 0;
+}
+
+// --- Helper Functions ---
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c cpus] [-t ms] [-q step_us] [-s slice_us]\n"
+            "          [-E [-e timeout_ms]] [-U [-m max_scale]]\n"
+            "          spec... | -r trace [-p pidmap]\n"
+            "  spec: uid:threads:run_us:sleep_us[:nice]\n"
+            "  -r  replay ftrace text (sched_switch, sched_wakeup) or CSV lines\n"
+            "      time_ns,event,pid,uid[,state] with event switch_in,\n"
+            "      switch_out or wakeup; -t defaults to the trace length\n"
+            "  -p  \"pid uid\" lines for ftrace input, e.g. ps -eo pid=,uid=\n"
+            "  -E  entangle CPUs 2k and 2k+1 (Task1), -e 0 is strict\n"
+            "  -U  penalise CPU-hog users (Task2B sched_user_fair), e.g.\n"
+            "      -c 4 -U -m 100 1000:500:5000:0 1001:5:5000:0 splits 50/50\n",
+            prog);
+}
+
+int parse_task_spec(const char *spec) {
+    unsigned int uid;
+    int threads, nice = 0;
+    unsigned long long run_us, sleep_us;
+
+    if (sscanf(spec, "%u:%d:%llu:%llu:%d", &uid, &threads, &run_us, &sleep_us, &nice) < 4)
+        return 0;
+    if (threads <= 0 || !run_us || nice < -20 || nice > 19)
+        return 0;
+
+    for (int i = 0; i < threads; i++) {
+        Burst *b = malloc(sizeof(Burst));
+        if (!b)
+            return 0;
+        b->run_ns = run_us * 1000ULL;
+        b->sleep_ns = sleep_us * 1000ULL;
+        if (!new_task(uid, nice, b, 1, 1, 0))
+            return 0;
+    }
+    return 1;
+}
+
+UserRecord *get_user(unsigned int uid) {
+    for (int i = 0; i < num_users; i++) {
+        if (users[i].uid == uid)
+            return &users[i];
+    }
+    if (num_users >= MAX_USERS)
+        return NULL;
+    memset(&users[num_users], 0, sizeof(UserRecord));
+    users[num_users].uid = uid;
+    return &users[num_users++];
+}
+
+/*
+ * Tasks starting at 0 are runnable from the beginning, spread round-robin
+ * over the CPUs; later ones are woken by simulate() at @start_ns.
+ */
+Task *new_task(unsigned int uid, int nice, Burst *bursts, int nr_bursts, int loop,
+               uint64_t start_ns) {
+    UserRecord *u = get_user(uid);
+    Task *p;
+
+    if (num_tasks >= MAX_TASKS || !u)
+        return NULL;
+
+    p = &tasks[num_tasks];
+    memset(p, 0, sizeof(*p));
+    p->id = num_tasks++;
+    p->uid = uid;
+    p->weight = prio_to_weight[nice + 20];
+    p->slice = base_slice_ns;
+    p->bursts = bursts;
+    p->nr_bursts = nr_bursts;
+    p->loop = loop;
+    p->cpu = p->id % nr_cpus;
+    u->nr_tasks++;
+
+    start_burst(p);
+    if (start_ns) {
+        p->wake_at = start_ns;
+        return p;
+    }
+    enqueue_task(&cpus[p->cpu], p, 1);
+    p->woken_at = 0;
+    p->waiting = 1;
+    return p;
+}
+
+void start_burst(Task *p) {
+    p->remaining = p->bursts[p->cur_burst].run_ns;
+}
+
+void simulate(void) {
+    for (sim_now = 0; sim_now < duration_ns; sim_now += step_ns) {
+        // Wakeups due this step
+        for (int i = 0; i < num_tasks; i++) {
+            Task *p = &tasks[i];
+            CpuRq *rq;
+
+            if (p->on_rq || p->done || p->wake_at > sim_now)
+                continue;
+
+            p->cpu = select_cpu(p);
+            rq = &cpus[p->cpu];
+            enqueue_task(rq, p, 0);
+            p->woken_at = p->wake_at;
+            p->waiting = 1;
+
+            // check_preempt_wakeup_fair(): eligible and earlier deadline
+            if (!rq->curr || (entity_eligible(rq, p) && p->deadline < rq->curr->deadline))
+                rq->need_resched = 1;
+        }
+
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            if (cpus[cpu].need_resched || !cpus[cpu].curr)
+                pick_next(cpu);
+        }
+
+        if (opt_user_fair)
+            update_user_util();
+
+        // Run every CPU for one step
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            CpuRq *rq = &cpus[cpu];
+            Task *p = rq->curr;
+            uint64_t delta;
+
+            if (!p) {
+                if (rq->forced)
+                    rq->forced_idle_ns += step_ns;
+                continue;
+            }
+
+            delta = p->remaining < step_ns ? p->remaining : step_ns;
+            update_curr(rq, delta);
+            p->remaining -= delta;
+            rq->busy_ns += delta;
+
+            if (p->remaining)
+                continue;
+
+            // Burst done: block, or go on with the next one
+            uint64_t sleep = p->bursts[p->cur_burst].sleep_ns;
+            p->cur_burst++;
+            if (p->cur_burst == p->nr_bursts) {
+                if (!p->loop) {
+                    p->done = 1;
+                    dequeue_task(rq, p);
+                    rq->curr = NULL;
+                    rq->need_resched = 1;
+                    continue;
+                }
+                p->cur_burst = 0;
+            }
+            start_burst(p);
+
+            if (sleep) {
+                dequeue_task(rq, p);
+                rq->curr = NULL;
+                p->wake_at = sim_now + delta + sleep;
+                rq->need_resched = 1;
+            }
+        }
+    }
+}
+
+/*
+ * avg_vruntime(): the load weighted average vruntime of the queue,
+ * including curr, kept relative to zero_vruntime to keep the sums small.
+ */
+int64_t avg_vruntime(CpuRq *rq) {
+    int64_t avg = 0;
+    long long load = 0;
+
+    for (int i = 0; i < rq->nr_queued; i++) {
+        Task *se = rq->queue[i];
+        avg += (se->vruntime - rq->zero_vruntime) * (int64_t)se->weight;
+        load += se->weight;
+    }
+    if (rq->curr && rq->curr->on_rq) {
+        avg += (rq->curr->vruntime - rq->zero_vruntime) * (int64_t)rq->curr->weight;
+        load += rq->curr->weight;
+    }
+
+    if (load) {
+        // Same rounding as fair.c: towards the left
+        if (avg < 0)
+            avg -= (load - 1);
+        avg /= load;
+    }
+    return rq->zero_vruntime + avg;
+}
+
+// entity_eligible(): lag >= 0, i.e. vruntime no later than the average
+int entity_eligible(CpuRq *rq, Task *se) {
+    int64_t avg = 0;
+    long long load = 0;
+
+    for (int i = 0; i < rq->nr_queued; i++) {
+        Task *t = rq->queue[i];
+        avg += (t->vruntime - rq->zero_vruntime) * (int64_t)t->weight;
+        load += t->weight;
+    }
+    if (rq->curr && rq->curr->on_rq) {
+        avg += (rq->curr->vruntime - rq->zero_vruntime) * (int64_t)rq->curr->weight;
+        load += rq->curr->weight;
+    }
+
+    return avg >= (se->vruntime - rq->zero_vruntime) * load;
+}
+
+// pick_eevdf(): the eligible entity with the earliest virtual deadline
+Task *pick_eevdf(CpuRq *rq) {
+    Task *curr = rq->curr;
+    Task *best = NULL;
+
+    if (curr && (!curr->on_rq || !entity_eligible(rq, curr)))
+        curr = NULL;
+
+    for (int i = 0; i < rq->nr_queued; i++) {
+        Task *se = rq->queue[i];
+
+        if (!entity_eligible(rq, se))
+            continue;
+        if (!best || se->deadline < best->deadline)
+            best = se;
+    }
+
+    if (!best || (curr && curr->deadline <= best->deadline))
+        best = curr;
+
+    // Nothing eligible can only be rounding; take the leftmost like fair.c
+    if (!best) {
+        for (int i = 0; i < rq->nr_queued; i++) {
+            if (!best || rq->queue[i]->vruntime < best->vruntime)
+                best = rq->queue[i];
+        }
+        if (!best)
+            best = rq->curr;
+    }
+    return best;
+}
+
+/*
+ * place_entity(): start at the average, minus the lag the task left with
+ * (inflated so that adding it doesn't move the average), deadline one
+ * virtual slice out; half a slice for new tasks (PLACE_DEADLINE_INITIAL).
+ */
+void place_entity(CpuRq *rq, Task *se, int initial) {
+    int64_t vslice = (int64_t)(se->slice * NICE_0_LOAD / se->weight);
+    int64_t vruntime = avg_vruntime(rq);
+    int64_t lag = 0;
+    long long load = 0;
+
+    for (int i = 0; i < rq->nr_queued; i++)
+        load += rq->queue[i]->weight;
+    if (rq->curr && rq->curr->on_rq)
+        load += rq->curr->weight;
+
+    if (load) {
+        lag = se->vlag;
+        lag *= load + (long long)se->weight;
+        lag /= load;
+    }
+
+    se->vruntime = vruntime - lag;
+    if (initial)
+        vslice /= 2;
+    se->deadline = se->vruntime + vslice;
+}
+
+/*
+ * update_curr(): charge @delta_exec to curr in virtual time, through the
+ * Task2B user penalty when it is on.
+ */
+void update_curr(CpuRq *rq, uint64_t delta_exec) {
+    Task *curr = rq->curr;
+    int64_t delta_fair = (int64_t)(delta_exec * NICE_0_LOAD / curr->weight);
+
+    if (opt_user_fair)
+        delta_fair = (int64_t)(delta_fair * user_fair_penalty(curr));
+
+    curr->vruntime += delta_fair;
+    curr->sum_exec += delta_exec;
+    get_user(curr->uid)->exec_ns += delta_exec;
+    get_user(curr->uid)->period_ns += delta_exec;
+
+    if (update_deadline(curr))
+        rq->need_resched = 1;
+}
+
+// update_deadline(): a new slice once the deadline is reached
+int update_deadline(Task *se) {
+    if (se->vruntime - se->deadline < 0)
+        return 0;
+
+    se->deadline = se->vruntime + (int64_t)(se->slice * NICE_0_LOAD / se->weight);
+    return 1;
+}
+
+void enqueue_task(CpuRq *rq, Task *p, int initial) {
+    place_entity(rq, p, initial);
+    rq->queue[rq->nr_queued++] = p;
+    p->on_rq = 1;
+}
+
+// Take @p off @rq, saving its lag clamped like update_entity_lag()
+void dequeue_task(CpuRq *rq, Task *p) {
+    int64_t limit = (int64_t)((2 * p->slice > TICK_NS ? 2 * p->slice : TICK_NS) *
+                              NICE_0_LOAD / p->weight);
+    int64_t lag = avg_vruntime(rq) - p->vruntime;
+
+    if (lag > limit)
+        lag = limit;
+    if (lag < -limit)
+        lag = -limit;
+    p->vlag = lag;
+
+    for (int i = 0; i < rq->nr_queued; i++) {
+        if (rq->queue[i] == p) {
+            rq->queue[i] = rq->queue[--rq->nr_queued];
+            break;
+        }
+    }
+    p->on_rq = 0;
+}
+
+/*
+ * pick_next_task_fair() with Task1's block: a task conflicting with the
+ * user on the sibling is swapped for a compatible one, or the CPU is
+ * forced idle until the timeout.
+ */
+void pick_next(int cpu) {
+    CpuRq *rq = &cpus[cpu];
+    struct timespec t0, t1;
+    Task *prev = rq->curr;
+    Task *p;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    rq->zero_vruntime = avg_vruntime(rq);
+    p = pick_eevdf(rq);
+
+    rq->forced = 0;
+    if (p && rq->group >= 0 && entangled_conflict(cpu, p)) {
+        Task *alt = entangle_pick_compatible(rq, cpu);
+
+        if (alt) {
+            p = alt;
+        } else {
+            nr_conflicts++;
+            if (!rq->idle_start)
+                rq->idle_start = sim_now + 1;   // 0 means not waiting
+            if (!entangle_timeout_ns || sim_now + 1 - rq->idle_start < entangle_timeout_ns) {
+                p = NULL;
+                rq->forced = 1;
+            } else {
+                nr_overrides++;
+                rq->idle_start = 0;
+            }
+        }
+    } else {
+        rq->idle_start = 0;
+    }
+
+    // put_prev: curr goes back into the queue
+    if (prev && prev->on_rq && prev != p)
+        rq->queue[rq->nr_queued++] = prev;
+    // set_next: the new curr leaves it
+    if (p && p != prev) {
+        for (int i = 0; i < rq->nr_queued; i++) {
+            if (rq->queue[i] == p) {
+                rq->queue[i] = rq->queue[--rq->nr_queued];
+                break;
+            }
+        }
+    }
+
+    rq->curr = p;
+    rq->need_resched = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    nr_picks++;
+    pick_host_ns += (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    if (p && p->waiting)
+        note_wakeup_latency(p);
+}
+
+// Does @p's user differ from the one running on @cpu's sibling?
+int entangled_conflict(int cpu, Task *p) {
+    int sibling = cpu ^ 1;
+    Task *other;
+
+    if (cpus[cpu].group < 0 || sibling >= nr_cpus)
+        return 0;
+
+    other = cpus[sibling].curr;
+    return other && other->uid != p->uid;
+}
+
+// entangle_pick_compatible(): best eligible non-conflicting task, bounded scan
+Task *entangle_pick_compatible(CpuRq *rq, int cpu) {
+    Task *best = NULL;
+    int budget = entangle_pick_scan;
+
+    if (rq->curr && rq->curr->on_rq && entity_eligible(rq, rq->curr) &&
+        !entangled_conflict(cpu, rq->curr))
+        best = rq->curr;
+
+    for (int i = 0; i < rq->nr_queued && budget; i++, budget--) {
+        Task *se = rq->queue[i];
+
+        if (!entity_eligible(rq, se) || entangled_conflict(cpu, se))
+            continue;
+        if (!best || se->deadline < best->deadline)
+            best = se;
+    }
+    return best;
+}
+
+/*
+ * select_idle_sibling(), reduced: the previous CPU if idle, else the first
+ * idle CPU that doesn't conflict, else the previous CPU anyway.
+ */
+int select_cpu(Task *p) {
+    if (!cpus[p->cpu].curr && !cpus[p->cpu].nr_queued && !entangled_conflict(p->cpu, p))
+        return p->cpu;
+
+    for (int i = 0; i < nr_cpus; i++) {
+        int cpu = (p->cpu + 1 + i) % nr_cpus;
+
+        if (!cpus[cpu].curr && !cpus[cpu].nr_queued && !entangled_conflict(cpu, p))
+            return cpu;
+    }
+    return p->cpu;
+}
+
+/*
+ * user_util_update() and user_fair_refresh(): every user's utilization
+ * decays by y per 1024us period, y^32 = 0.5, and every refresh period
+ * each user's penalty is multiplied by its share over the equal one.
+ */
+#define PELT_PERIOD_NS 1024000ULL
+#define PELT_Y 0.978572    // runnable_avg_yN_inv[1] / 2^32
+#define USER_FAIR_PERIOD_NS 32000000ULL  // sysctl_sched_user_fair_period_ms
+#define USER_FAIR_MIN_UTIL (1.0 / 64)    // below that a user is not counted
+
+void update_user_util(void) {
+    uint64_t next = sim_now + step_ns;
+    int nr = 0;
+    double total = 0.0;
+
+    if (next / PELT_PERIOD_NS != sim_now / PELT_PERIOD_NS) {
+        for (int i = 0; i < num_users; i++) {
+            UserRecord *u = &users[i];
+
+            u->util_sum = u->util_sum * PELT_Y + (double)u->period_ns / PELT_PERIOD_NS;
+            u->util = u->util_sum * (1.0 - PELT_Y);
+            u->period_ns = 0;
+        }
+    }
+
+    if (next / USER_FAIR_PERIOD_NS == sim_now / USER_FAIR_PERIOD_NS)
+        return;
+
+    for (int i = 0; i < num_users; i++) {
+        if (users[i].util >= USER_FAIR_MIN_UTIL) {
+            total += users[i].util;
+            nr++;
+        }
+    }
+    for (int i = 0; i < num_users; i++) {
+        UserRecord *u = &users[i];
+        double scale = u->fair_scale ? u->fair_scale : 1.0;
+
+        if (nr < 2 || u->util < USER_FAIR_MIN_UTIL) {
+            u->fair_scale = 1.0;
+            continue;
+        }
+        scale *= u->util * nr / total;
+        if (scale < 1.0)
+            scale = 1.0;
+        if (scale > user_fair_max_scale)
+            scale = user_fair_max_scale;
+        u->fair_scale = scale;
+    }
+}
+
+// user_fair_penalty(): the user's current scale
+double user_fair_penalty(Task *p) {
+    UserRecord *u = get_user(p->uid);
+
+    return u->fair_scale ? u->fair_scale : 1.0;
+}
+
+void note_wakeup_latency(Task *p) {
+    uint64_t lat = sim_now > p->woken_at ? sim_now - p->woken_at : 0;
+
+    p->waiting = 0;
+    if (nr_wakeups == wakeup_lats_cap) {
+        size_t cap = wakeup_lats_cap ? wakeup_lats_cap * 2 : 4096;
+        uint64_t *lats = realloc(wakeup_lats, cap * sizeof(uint64_t));
+
+        if (!lats)
+            return;     // keep going, the percentiles just miss the rest
+        wakeup_lats = lats;
+        wakeup_lats_cap = cap;
+    }
+    wakeup_lats[nr_wakeups++] = lat;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void print_results(void) {
+    uint64_t total = 0, forced = 0, capacity = (uint64_t)nr_cpus * duration_ns;
+    double sum = 0.0, sum_sq = 0.0;
+
+    for (int i = 0; i < num_users; i++)
+        total += users[i].exec_ns;
+    for (int cpu = 0; cpu < nr_cpus; cpu++)
+        forced += cpus[cpu].forced_idle_ns;
+
+    printf("User\tThreads\tCPU Time (milliseconds)\tShare (%%)\n");
+    for (int i = 0; i < num_users; i++) {
+        double share = total ? 100.0 * users[i].exec_ns / total : 0.0;
+
+        printf("%u\t%d\t%llu\t%.2f\n", users[i].uid, users[i].nr_tasks,
+               (unsigned long long)(users[i].exec_ns / 1000000ULL), share);
+        sum += share;
+        sum_sq += share * share;
+    }
+
+    // Jain's index over the users' shares: 1.0 is a perfectly even split
+    printf("\nFairness (Jain)\t%.4f\n", sum_sq > 0.0 ? sum * sum / (num_users * sum_sq) : 1.0);
+    printf("Utilization (%%)\t%.2f\n", 100.0 * total / capacity);
+    printf("Forced idle (milliseconds)\t%llu\t%.2f%%\n",
+           (unsigned long long)(forced / 1000000ULL), 100.0 * forced / capacity);
+    printf("Conflicts\t%llu\n", nr_conflicts);
+    printf("Overrides\t%llu\n", nr_overrides);
+
+    printf("Wakeup latency p50/p90/p99/max (us)");
+    if (nr_wakeups) {
+        qsort(wakeup_lats, nr_wakeups, sizeof(uint64_t), cmp_u64);
+        printf("\t%.1f\t%.1f\t%.1f\t%.1f\n",
+               wakeup_lats[nr_wakeups * 50 / 100] / 1000.0,
+               wakeup_lats[nr_wakeups * 90 / 100] / 1000.0,
+               wakeup_lats[nr_wakeups * 99 / 100] / 1000.0,
+               wakeup_lats[nr_wakeups - 1] / 1000.0);
+    } else {
+        printf("\t-\t-\t-\t-\n");
+    }
+    printf("Picks\t%llu\t%.1f ns/pick\n", nr_picks, nr_picks ? pick_host_ns / nr_picks : 0.0);
+}
+
+// --- Trace Replay ---
+
+// "pid uid" pairs, for ftrace input which doesn't carry the uid
+int *pidmap_pids;
+unsigned int *pidmap_uids;
+int pidmap_len = 0;
+
+int load_pidmap(const char *path) {
+    FILE *f = fopen(path, "r");
+    int cap = 0, pid;
+    unsigned int uid;
+
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    while (fscanf(f, "%d %u", &pid, &uid) == 2) {
+        if (pidmap_len == cap) {
+            cap = cap ? cap * 2 : 1024;
+            pidmap_pids = realloc(pidmap_pids, cap * sizeof(int));
+            pidmap_uids = realloc(pidmap_uids, cap * sizeof(unsigned int));
+            if (!pidmap_pids || !pidmap_uids) {
+                perror("realloc");
+                fclose(f);
+                return 0;
+            }
+        }
+        pidmap_pids[pidmap_len] = pid;
+        pidmap_uids[pidmap_len++] = uid;
+    }
+    fclose(f);
+    return 1;
+}
+
+/*
+ * Read the whole trace, rebuild every task's bursts, then turn each into a
+ * simulated task starting when it was first runnable. Pid 0 is the idle
+ * task and is left out.
+ */
+int load_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    unsigned long long lines = 0, events = 0;
+
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+
+    trace_tasks = calloc(MAX_TASKS, sizeof(TraceTask));
+    if (!trace_tasks) {
+        perror("calloc");
+        fclose(f);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        int ret;
+
+        lines++;
+        if (line[0] == '#')
+            continue;
+        ret = strstr(line, ": sched_") ? parse_ftrace_line(line) : parse_csv_line(line);
+        if (ret < 0) {
+            fprintf(stderr, "%s:%llu: too many tasks (max %d)\n", path, lines, MAX_TASKS);
+            fclose(f);
+            return 0;
+        }
+        events += ret;
+    }
+    fclose(f);
+
+    if (!events) {
+        fprintf(stderr, "%s: no sched_switch or sched_wakeup events\n", path);
+        return 0;
+    }
+
+    for (int i = 0; i < nr_trace_tasks; i++) {
+        TraceTask *t = &trace_tasks[i];
+
+        // Still on the CPU when the trace stopped
+        if (t->state == TRACE_RUNNING)
+            t->run_acc += trace_end - t->run_start;
+        if (t->run_acc && !push_burst(t, t->run_acc))
+            return 0;
+        if (!t->nr_bursts)
+            continue;
+        if (!new_task(t->uid, t->nice, t->bursts, t->nr_bursts, 0, t->first_ts - trace_start))
+            return 0;
+    }
+    return 1;
+}
+
+TraceTask *trace_task(int pid, int prio, uint64_t ts) {
+    unsigned int h = (unsigned int)pid & (PID_HASH_SIZE - 1);
+    TraceTask *t;
+
+    if (ts < trace_start)
+        trace_start = ts;
+    if (ts > trace_end)
+        trace_end = ts;
+
+    while (pid_hash[h]) {
+        t = &trace_tasks[pid_hash[h] - 1];
+        if (t->pid == pid)
+            return t;
+        h = (h + 1) & (PID_HASH_SIZE - 1);
+    }
+
+    if (nr_trace_tasks >= MAX_TASKS)
+        return NULL;
+
+    t = &trace_tasks[nr_trace_tasks];
+    pid_hash[h] = ++nr_trace_tasks;
+    t->pid = pid;
+    // Normal priorities are 100..139; RT tasks are replayed at nice 0
+    t->nice = prio >= 100 && prio < 140 ? prio - 120 : 0;
+    for (int i = 0; i < pidmap_len; i++) {
+        if (pidmap_pids[i] == pid) {
+            t->uid = pidmap_uids[i];
+            break;
+        }
+    }
+    return t;
+}
+
+int push_burst(TraceTask *t, uint64_t run_ns) {
+    if (t->nr_bursts == t->max_bursts) {
+        int max = t->max_bursts ? t->max_bursts * 2 : 16;
+        Burst *b = realloc(t->bursts, max * sizeof(Burst));
+
+        if (!b) {
+            perror("realloc");
+            return 0;
+        }
+        t->bursts = b;
+        t->max_bursts = max;
+    }
+    t->bursts[t->nr_bursts].run_ns = run_ns;
+    t->bursts[t->nr_bursts++].sleep_ns = 0;
+    return 1;
+}
+
+// Preempted (R, R+) stays runnable; any other state ends the burst
+void trace_switch_out(int pid, int prio, const char *state, uint64_t ts) {
+    TraceTask *t = trace_task(pid, prio, ts);
+
+    if (!t)
+        return;
+    if (t->state == TRACE_RUNNING)
+        t->run_acc += ts - t->run_start;
+
+    if (state[0] == 'R') {
+        t->state = TRACE_RUNNABLE;
+        return;
+    }
+
+    if (t->run_acc) {
+        push_burst(t, t->run_acc);
+        t->run_acc = 0;
+    }
+    t->state = TRACE_SLEEPING;
+    t->sleep_start = ts;
+}
+
+void trace_switch_in(int pid, int prio, uint64_t ts) {
+    TraceTask *t = trace_task(pid, prio, ts);
+
+    if (!t)
+        return;
+    if (!t->started) {
+        t->first_ts = ts;
+        t->started = 1;
+    }
+    t->state = TRACE_RUNNING;
+    t->run_start = ts;
+}
+
+// The sleep since the last block belongs to the burst before it
+void trace_wakeup(int pid, int prio, uint64_t ts) {
+    TraceTask *t = trace_task(pid, prio, ts);
+
+    if (!t || t->state == TRACE_RUNNING || t->state == TRACE_RUNNABLE)
+        return;
+    if (t->state == TRACE_SLEEPING && t->nr_bursts)
+        t->bursts[t->nr_bursts - 1].sleep_ns += ts - t->sleep_start;
+    if (!t->started) {
+        t->first_ts = ts;
+        t->started = 1;
+    }
+    t->state = TRACE_RUNNABLE;
+}
+
+/*
+ * One line of "trace" output, e.g.
+ *   bash-1234 [001] d..2. 5678.901234: sched_switch: prev_comm=bash
+ *     prev_pid=1234 prev_prio=120 prev_state=S ==> next_comm=cc1
+ *     next_pid=4321 next_prio=120
+ *   cc1-4321 [001] d..2. 5678.901300: sched_wakeup: comm=bash pid=1234
+ *     prio=120 target_cpu=001
+ * Returns 1 for an event, 0 for anything else, -1 when out of tasks.
+ */
+int parse_ftrace_line(const char *line) {
+    const char *ev = strstr(line, ": sched_");
+    const char *ts_start = ev, *field;
+    uint64_t ts;
+    int pid, prio = 120;
+
+    // The timestamp is the "secs.usecs" right before the event name
+    while (ts_start > line && (ts_start[-1] == '.' || (ts_start[-1] >= '0' && ts_start[-1] <= '9')))
+        ts_start--;
+    if (ts_start == ev)
+        return 0;
+    ts = (uint64_t)(strtod(ts_start, NULL) * 1e9 + 0.5);
+    ev += 2;
+
+    if (!strncmp(ev, "sched_switch:", 13)) {
+        char state[8] = "";
+        int next_pid, next_prio = 120;
+
+        if (!(field = strstr(ev, "prev_pid=")) || sscanf(field, "prev_pid=%d", &pid) != 1)
+            return 0;
+        if ((field = strstr(ev, "prev_prio=")))
+            sscanf(field, "prev_prio=%d", &prio);
+        if (!(field = strstr(ev, "prev_state=")) || sscanf(field, "prev_state=%7s", state) != 1)
+            return 0;
+        if (!(field = strstr(ev, "next_pid=")) || sscanf(field, "next_pid=%d", &next_pid) != 1)
+            return 0;
+        if ((field = strstr(ev, "next_prio=")))
+            sscanf(field, "next_prio=%d", &next_prio);
+
+        if (pid && !trace_task(pid, prio, ts))
+            return -1;
+        if (next_pid && !trace_task(next_pid, next_prio, ts))
+            return -1;
+        if (pid)
+            trace_switch_out(pid, prio, state, ts);
+        if (next_pid)
+            trace_switch_in(next_pid, next_prio, ts);
+        return 1;
+    }
+
+    if (!strncmp(ev, "sched_wakeup:", 13) || !strncmp(ev, "sched_wakeup_new:", 17)) {
+        if (!(field = strstr(ev, " pid=")) || sscanf(field, " pid=%d", &pid) != 1)
+            return 0;
+        if ((field = strstr(ev, " prio=")))
+            sscanf(field, " prio=%d", &prio);
+        if (!pid)
+            return 0;
+        if (!trace_task(pid, prio, ts))
+            return -1;
+        trace_wakeup(pid, prio, ts);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * time_ns,event,pid,uid[,state], one event per line, with event one of
+ * switch_in, switch_out or wakeup and state the prev_state of a
+ * switch_out. Lines that don't parse, like a header, are skipped.
+ */
+int parse_csv_line(const char *line) {
+    unsigned long long ts;
+    char event[16], state[8] = "S";
+    int pid;
+    unsigned int uid;
+    TraceTask *t;
+
+    if (sscanf(line, "%llu,%15[^,],%d,%u,%7[^,\n]", &ts, event, &pid, &uid, state) < 4 || !pid)
+        return 0;
+
+    t = trace_task(pid, 120, ts);
+    if (!t)
+        return -1;
+    t->uid = uid;
+
+    if (!strcmp(event, "switch_in"))
+        trace_switch_in(pid, 120, ts);
+    else if (!strcmp(event, "switch_out"))
+        trace_switch_out(pid, 120, state, ts);
+    else if (!strcmp(event, "wakeup"))
+        trace_wakeup(pid, 120, ts);
+    else
+        return 0;
+    return 1;
+}
@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the entanglement code. #included at the end of fair.c,
+ * like ext4's mballoc-test.c, so the static helpers can be reached, and
+ * built whenever KUnit is built in. Run with
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=kernel/sched
+ *
+ * The decisions are checked against a private group and private per-CPU
+ * uids, never the installed config or a live CPU's state, so every case
+ * runs on UML, which is UP.
+ */
+#include <kunit/test.h>
+
+#define ENTANGLE_TEST_UID_A 0x40000001
+#define ENTANGLE_TEST_UID_B 0x40000002
+#define ENTANGLE_TEST_LOOPS 100000
+/* A call is a handful of loads; this leaves room for UML and debug kernels */
+#define ENTANGLE_TEST_MAX_NS 1000
+
+KUNIT_DEFINE_ACTION_WRAPPER(entangle_test_free_percpu, free_percpu, void __percpu *);
+
+/*
+ * A group of CPU 0 alone, with its own uids. The decisions are asked for
+ * ENTANGLE_TEST_CPU, which is not a CPU and so not in the group: CPU 0
+ * plays its sibling, which works with a single CPU.
+ */
+struct entangle_test_ctx {
+    struct entangle_group grp;
+    struct entangle_uids uids;
+};
+
+#define ENTANGLE_TEST_CPU ((int)nr_cpu_ids)
+
+static uid_t __percpu *entangle_test_alloc_uids(struct kunit *test)
+{
+    uid_t __percpu *uids = alloc_percpu(uid_t);
+    int cpu;
+
+    KUNIT_ASSERT_NOT_NULL(test, uids);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, entangle_test_free_percpu, uids), 0);
+    for_each_possible_cpu(cpu)
+        *per_cpu_ptr(uids, cpu) = ENTANGLE_NO_UID;
+    return uids;
+}
+
+static struct entangle_test_ctx *entangle_test_ctx(struct kunit *test, enum entangle_policy policy)
+{
+    struct entangle_test_ctx *ctx;
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    ctx->grp.cpus = kunit_kzalloc(test, cpumask_size(), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx->grp.cpus);
+    cpumask_set_cpu(0, ctx->grp.cpus);
+    ctx->grp.policy = policy;
+    ctx->grp.timeout_ns = ENTANGLE_DEFAULT_TIMEOUT_NS;
+    ctx->grp.owner = ENTANGLE_NO_UID;
+    ctx->uids.curr = entangle_test_alloc_uids(test);
+    ctx->uids.want = entangle_test_alloc_uids(test);
+    return ctx;
+}
+
+/* What the sibling, CPU 0, runs and waits for */
+static void entangle_test_sibling(struct entangle_test_ctx *ctx, uid_t curr, uid_t want)
+{
+    *per_cpu_ptr(ctx->uids.curr, 0) = curr;
+    *per_cpu_ptr(ctx->uids.want, 0) = want;
+}
+
+static bool entangle_test_blocked(struct entangle_test_ctx *ctx, uid_t uid)
+{
+    return __entangle_blocked(&ctx->grp, &ctx->uids, ENTANGLE_TEST_CPU, uid);
+}
+
+static int entangle_test_parse(const char *str, struct entangle_group *grp)
+{
+    char buf[32];
+
+    strscpy(buf, str, sizeof(buf));
+    memset(grp, 0, sizeof(*grp));
+    grp->timeout_ns = ENTANGLE_DEFAULT_TIMEOUT_NS;
+    return entangle_parse_policy(buf, grp);
+}
+
+static void entangle_test_parse_policy(struct kunit *test)
+{
+    struct entangle_group grp;
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("strict", &grp), 0);
+    KUNIT_EXPECT_EQ(test, grp.policy, ENTANGLE_STRICT);
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("timeout", &grp), 0);
+    KUNIT_EXPECT_EQ(test, grp.policy, ENTANGLE_TIMEOUT);
+    KUNIT_EXPECT_EQ(test, grp.timeout_ns, ENTANGLE_DEFAULT_TIMEOUT_NS);
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("timeout=50", &grp), 0);
+    KUNIT_EXPECT_EQ(test, grp.timeout_ns, 50 * NSEC_PER_MSEC);
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("alternate=10", &grp), 0);
+    KUNIT_EXPECT_EQ(test, grp.policy, ENTANGLE_ALTERNATE);
+    KUNIT_EXPECT_EQ(test, grp.timeout_ns, 10 * NSEC_PER_MSEC);
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("gang", &grp), 0);
+    KUNIT_EXPECT_EQ(test, grp.policy, ENTANGLE_GANG);
+    KUNIT_EXPECT_EQ(test, grp.timeout_ns, ENTANGLE_DEFAULT_GANG_NS);
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("strict=5", &grp), -EINVAL);
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("timeout=0", &grp), -EINVAL);
+    KUNIT_EXPECT_EQ(test, entangle_test_parse("bogus", &grp), -EINVAL);
+    KUNIT_EXPECT_LT(test, entangle_test_parse("timeout=x", &grp), 0);
+}
+
+static int entangle_test_parse_groups_str(const char *str, struct entangle_config **cfgp)
+{
+    char buf[64];
+
+    strscpy(buf, str, sizeof(buf));
+    return entangle_parse_groups(buf, cfgp);
+}
+
+static void entangle_test_parse_groups(struct kunit *test)
+{
+    struct entangle_config *cfg;
+    char buf[64];
+    int first, second;
+
+    KUNIT_EXPECT_EQ(test, entangle_test_parse_groups_str("", &cfg), 0);
+    KUNIT_EXPECT_NULL(test, cfg);
+
+    // Groups need two CPUs and may not overlap (-ERANGE past NR_CPUS)
+    KUNIT_EXPECT_EQ(test, entangle_test_parse_groups_str("0", &cfg), -EINVAL);
+    KUNIT_EXPECT_LT(test, entangle_test_parse_groups_str("0-1;1-2", &cfg), 0);
+    KUNIT_EXPECT_LT(test, entangle_test_parse_groups_str("0-1:bogus", &cfg), 0);
+    KUNIT_EXPECT_NULL(test, cfg);
+
+    // On UP no group can be formed at all
+    first = cpumask_first(cpu_possible_mask);
+    second = cpumask_next(first, cpu_possible_mask);
+    if (second >= nr_cpu_ids) {
+        KUNIT_EXPECT_LT(test, entangle_test_parse_groups_str("0-1:strict", &cfg), 0);
+        KUNIT_EXPECT_NULL(test, cfg);
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%d,%d:timeout=50", first, second);
+    KUNIT_ASSERT_EQ(test, entangle_test_parse_groups_str(buf, &cfg), 0);
+    KUNIT_ASSERT_NOT_NULL(test, cfg);
+    KUNIT_EXPECT_EQ(test, cfg->nr_groups, 1U);
+    KUNIT_EXPECT_EQ(test, cfg->groups[0].policy, ENTANGLE_TIMEOUT);
+    KUNIT_EXPECT_EQ(test, cfg->groups[0].timeout_ns, 50 * NSEC_PER_MSEC);
+    KUNIT_EXPECT_EQ(test, cpumask_weight(cfg->groups[0].cpus), 2U);
+    KUNIT_EXPECT_TRUE(test, cpumask_test_cpu(second, cfg->groups[0].cpus));
+    entangle_free_config(cfg);
+}
+
+/* A conflicting task waits until the deadline, and not a nanosecond longer */
+static void entangle_test_timeout_expiry(struct kunit *test)
+{
+    struct entangle_group grp = { .timeout_ns = 50 * NSEC_PER_MSEC };
+    u64 start = 1000, deadline;
+
+    grp.policy = ENTANGLE_TIMEOUT;
+    deadline = entangle_wait_deadline(&grp, start);
+    KUNIT_EXPECT_EQ(test, deadline, start + 50 * NSEC_PER_MSEC);
+
+    grp.policy = ENTANGLE_ALTERNATE;
+    KUNIT_EXPECT_EQ(test, entangle_wait_deadline(&grp, start), deadline);
+
+    // Only the kicks and gang_timer release strict and gang groups
+    grp.policy = ENTANGLE_STRICT;
+    KUNIT_EXPECT_EQ(test, entangle_wait_deadline(&grp, start), U64_MAX);
+    grp.policy = ENTANGLE_GANG;
+    KUNIT_EXPECT_EQ(test, entangle_wait_deadline(&grp, start), U64_MAX);
+}
+
+static void entangle_test_conflict(struct kunit *test)
+{
+    struct entangle_test_ctx *ctx = entangle_test_ctx(test, ENTANGLE_TIMEOUT);
+
+    entangle_test_sibling(ctx, ENTANGLE_TEST_UID_A, ENTANGLE_NO_UID);
+    KUNIT_EXPECT_FALSE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_A));
+    KUNIT_EXPECT_TRUE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B));
+
+    // A CPU is never its own sibling
+    KUNIT_EXPECT_FALSE(test, __entangle_blocked(&ctx->grp, &ctx->uids, 0, ENTANGLE_TEST_UID_B));
+
+    // Idle or another class on the sibling conflicts with no one
+    entangle_test_sibling(ctx, ENTANGLE_NO_UID, ENTANGLE_NO_UID);
+    KUNIT_EXPECT_FALSE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B));
+}
+
+static void entangle_test_gang(struct kunit *test)
+{
+    struct entangle_test_ctx *ctx = entangle_test_ctx(test, ENTANGLE_GANG);
+
+    ctx->grp.owner = ENTANGLE_TEST_UID_A;
+
+    // Just rotated to A, the sibling still runs B: A waits too
+    entangle_test_sibling(ctx, ENTANGLE_TEST_UID_B, ENTANGLE_NO_UID);
+    KUNIT_EXPECT_TRUE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_A));
+
+    // The owner runs on the sibling: B is refused, A is fine
+    entangle_test_sibling(ctx, ENTANGLE_TEST_UID_A, ENTANGLE_NO_UID);
+    KUNIT_EXPECT_FALSE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_A));
+    KUNIT_EXPECT_TRUE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B));
+
+    // The sibling idles waiting for the owner: B is still refused
+    entangle_test_sibling(ctx, ENTANGLE_NO_UID, ENTANGLE_TEST_UID_A);
+    KUNIT_EXPECT_TRUE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B));
+
+    // Nobody runs or waits for the owner anymore: B may run
+    entangle_test_sibling(ctx, ENTANGLE_NO_UID, ENTANGLE_NO_UID);
+    KUNIT_EXPECT_FALSE(test, entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B));
+}
+
+/* Per-call cost of the check every pick makes, once a group is installed */
+static void entangle_test_hot_path_cost(struct kunit *test)
+{
+    struct entangle_test_ctx *ctx = entangle_test_ctx(test, ENTANGLE_TIMEOUT);
+    unsigned int blocked = 0;
+    u64 start, per_call;
+    int i;
+
+    entangle_test_sibling(ctx, ENTANGLE_TEST_UID_A, ENTANGLE_NO_UID);
+
+    preempt_disable();
+    start = ktime_get_ns();
+    for (i = 0; i < ENTANGLE_TEST_LOOPS; i++)
+        blocked += entangle_test_blocked(ctx, ENTANGLE_TEST_UID_B);
+    per_call = div_u64(ktime_get_ns() - start, ENTANGLE_TEST_LOOPS);
+    preempt_enable();
+
+    kunit_info(test, "__entangle_blocked(): %llu ns per call\n", per_call);
+    KUNIT_EXPECT_EQ(test, blocked, (unsigned int)ENTANGLE_TEST_LOOPS);
+    KUNIT_EXPECT_LT(test, per_call, (u64)ENTANGLE_TEST_MAX_NS);
+}
+
+static struct kunit_case entangle_test_cases[] = {
+    KUNIT_CASE(entangle_test_parse_policy),
+    KUNIT_CASE(entangle_test_parse_groups),
+    KUNIT_CASE(entangle_test_timeout_expiry),
+    KUNIT_CASE(entangle_test_conflict),
+    KUNIT_CASE(entangle_test_gang),
+    KUNIT_CASE(entangle_test_hot_path_cost),
+    {}
+};
+
+static struct kunit_suite entangle_test_suite = {
+    .name = "sched_entangle",
+    .test_cases = entangle_test_cases,
+};
+
+kunit_test_suite(entangle_test_suite);
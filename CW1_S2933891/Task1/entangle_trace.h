@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the entangled CPU decisions in pick_next_task_fair().
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM entangle
+
+#if !defined(_TRACE_ENTANGLE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ENTANGLE_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * The best task for @cpu conflicts with its entanglement group and no
+ * compatible one was found; @forced tells whether the CPU goes idle for it.
+ */
+TRACE_EVENT(entangle_conflict,
+
+    TP_PROTO(int cpu, struct task_struct *p, bool forced),
+
+    TP_ARGS(cpu, p, forced),
+
+    TP_STRUCT__entry(
+        __field(int, cpu)
+        __field(pid_t, pid)
+        __field(uid_t, uid)
+        __field(bool, forced)
+    ),
+
+    TP_fast_assign(
+        __entry->cpu = cpu;
+        __entry->pid = p->pid;
+        __entry->uid = __kuid_val(task_uid(p));
+        __entry->forced = forced;
+    ),
+
+    TP_printk("cpu=%d pid=%d uid=%u forced=%d",
+              __entry->cpu, __entry->pid, __entry->uid, __entry->forced)
+);
+
+/*
+ * The group's timeout ran out and @p runs despite the conflict, after
+ * @cpu waited @waited_ns for it.
+ */
+TRACE_EVENT(entangle_override,
+
+    TP_PROTO(int cpu, struct task_struct *p, u64 waited_ns),
+
+    TP_ARGS(cpu, p, waited_ns),
+
+    TP_STRUCT__entry(
+        __field(int, cpu)
+        __field(pid_t, pid)
+        __field(uid_t, uid)
+        __field(u64, waited_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->cpu = cpu;
+        __entry->pid = p->pid;
+        __entry->uid = __kuid_val(task_uid(p));
+        __entry->waited_ns = waited_ns;
+    ),
+
+    TP_printk("cpu=%d pid=%d uid=%u waited_ns=%llu",
+              __entry->cpu, __entry->pid, __entry->uid,
+              (unsigned long long)__entry->waited_ns)
+);
+
+#endif /* _TRACE_ENTANGLE_H */
+
+/*
+ * Lives next to fair.c rather than in include/trace/events. define_trace.h
+ * includes it again relative to include/trace/, so point there from the
+ * tree root, as i915 does, instead of adding -I$(src) to the Makefile.
+ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../kernel/sched
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE entangle_trace
+
+#include <trace/define_trace.h>
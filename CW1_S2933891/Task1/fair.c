@@ -55,11 +55,1024 @@
 #include "stats.h"
 #include "autogroup.h"
 
+#include <linux/cpuhotplug.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "entangle_trace.h"
+
+/*
+ * Entangled CPUs: CPUs of the same entanglement group never run tasks of
+ * two different users at the same time. A CPU whose picked task conflicts
+ * with the user running on another CPU of its group is forced idle.
+ *
+ * Groups are set either as a single pair through entangled_cpus_1/2, or as
+ * any number of disjoint groups of any size through entangled_cpu_groups,
+ * e.g. "0,32;1,33;2-3". Each CPU points at its own group, so the check in
+ * pick_next_task_fair() only walks that group's mask and never allocates.
+ *
+ * Each group may carry a policy for how long a conflicting task waits,
+ * e.g. "0-1:strict;2-3:timeout=50;4-5:alternate=10" (times in ms):
+ *   timeout   - forced idle for at most the timeout, then the task runs
+ *               anyway (the default, with a 10 second timeout)
+ *   strict    - forced idle for as long as the conflict lasts
+ *   alternate - after the slice, the waiting user takes over and the group
+ *               CPUs running the other user are made to wait in turn
+ *   gang      - the group is owned by one user at a time. While another
+ *               user waits, ownership rotates every slice (10ms unless
+ *               given) and all CPUs of the group switch together
+ */
 static unsigned int sysctl_entangled_cpu1 = 0;
 static unsigned int sysctl_entangled_cpu2 = 0;
+static char sysctl_entangled_cpu_groups[4096];
+/*
+ * Max queued entities pick_next_task_fair() looks at for a compatible task.
+ * 0 only tries the running task; the walk is under the rq lock, hence the cap.
+ */
+static unsigned int sysctl_entangled_pick_scan = 8;
+static unsigned int sysctl_entangled_pick_scan_max = 64;
+
+/*
+ * entangled_cpus_smt: derive the groups from the SMT topology instead, one
+ * group per core with two or more online hyperthreads (cpu_smt_mask(), the
+ * span of the SD_SHARE_CPUCAPACITY domain). The groups follow CPU hotplug,
+ * and manual configuration is refused while this is set.
+ */
+static unsigned int sysctl_entangled_cpus_smt = 0;
 
-/* Array to track when a CPU started being forced idle (in nanoseconds) */
-static u64 entangled_idle_start[NR_CPUS] = {0};
+enum entangle_policy {
+    ENTANGLE_TIMEOUT = 0,
+    ENTANGLE_STRICT,
+    ENTANGLE_ALTERNATE,
+    ENTANGLE_GANG,
+};
+
+struct entangle_group {
+    struct cpumask *cpus;
+    enum entangle_policy policy;
+    u64 timeout_ns;  /* timeout, or slice for ENTANGLE_ALTERNATE/GANG */
+
+    /* ENTANGLE_GANG only */
+    uid_t owner;
+    raw_spinlock_t gang_lock;
+    bool gang_active;  /* gang_timer running, under gang_lock */
+    int gang_cpu;      /* CPU whose user got the last window */
+    struct hrtimer gang_timer;
+};
+
+struct entangle_config {
+    unsigned int nr_groups;
+    struct entangle_group groups[];
+};
+
+static struct entangle_config *entangle_config;
+static DEFINE_PER_CPU(struct entangle_group __rcu *, entangle_group);
+static DEFINE_MUTEX(entangle_mutex);
+/*
+ * Enabled while any group is installed. Every entanglement hook on the pick
+ * and context switch paths (here and in core.c) sits behind it, so without
+ * groups they cost nothing. Defined in core.c, the one Task2B/core.c both
+ * tasks build with, so that it links with either fair.c.
+ */
+DECLARE_STATIC_KEY_FALSE(sched_entangle_key);
+
+/*
+ * When this CPU started being forced idle, in rq_clock() nanoseconds (0 if
+ * it isn't). Per-CPU so neighbouring CPUs never share its cacheline.
+ */
+static DEFINE_PER_CPU(u64, entangled_idle_start);
+
+/*
+ * A forced idle CPU is re-evaluated at the exact starvation deadline by
+ * entangle_timer, and as soon as a CPU of its group switches user through
+ * an entangle_kick IPI, rather than at the next unrelated reschedule.
+ */
+#define ENTANGLE_DEFAULT_TIMEOUT_NS 10000000000ULL /* 10 seconds */
+#define ENTANGLE_DEFAULT_GANG_NS (10 * NSEC_PER_MSEC)
+#define ENTANGLE_NO_UID ((uid_t)-1)
+
+static DEFINE_PER_CPU(bool, entangle_forced);
+/*
+ * User of the fair task running on this CPU, ENTANGLE_NO_UID when it runs
+ * idle or another class. Published by set_next_task_fair() and
+ * put_prev_task_fair(), so group siblings never dereference our curr.
+ */
+static DEFINE_PER_CPU(uid_t, entangle_curr_uid) = ENTANGLE_NO_UID;
+/* Set when an alternate slice ran out here: every group CPU gets kicked */
+static DEFINE_PER_CPU(bool, entangle_kick_all);
+static DEFINE_PER_CPU(uid_t, entangle_last_uid) = ENTANGLE_NO_UID;
+static DEFINE_PER_CPU(struct hrtimer, entangle_timer);
+static DEFINE_PER_CPU(struct irq_work, entangle_kick);
+
+/*
+ * Same for a task of another class refused by the core.c pick: when its
+ * wait began, whether it is waiting, and its own starvation timer, so the
+ * fair pick running meanwhile doesn't restart its clock.
+ */
+static DEFINE_PER_CPU(u64, entangle_class_wait_start);
+static DEFINE_PER_CPU(bool, entangle_class_blocked);
+static DEFINE_PER_CPU(struct hrtimer, entangle_class_timer);
+/* User a forced idle CPU of a gang group waits for, read by gang_timer */
+static DEFINE_PER_CPU(uid_t, entangle_want_uid) = ENTANGLE_NO_UID;
+
+/*
+ * What the entanglement costs, per CPU, shown in /proc/sched_entangle_stats.
+ * Only written by the owning CPU under its rq lock.
+ */
+struct entangle_stats {
+    u64 forced_idle_ns;  /* time spent in completed forced idle periods */
+    u64 forced_start;    /* rq_clock() when the current forced idle began */
+    u64 nr_conflicts;    /* picks where no compatible task was found */
+    u64 nr_overrides;    /* conflicts let through by the timeout */
+};
+
+static DEFINE_PER_CPU(struct entangle_stats, entangle_stats);
+
+/*
+ * End of a gang window: hand the group to the next waiting user, taking
+ * the CPUs round-robin so every user gets its turn, and kick all CPUs of
+ * the group so they switch together. Stops once nobody waits anymore.
+ */
+static enum hrtimer_restart entangle_gang_timer_fn(struct hrtimer *timer)
+{
+    struct entangle_group *grp = container_of(timer, struct entangle_group, gang_timer);
+    uid_t owner = READ_ONCE(grp->owner);
+    uid_t next = ENTANGLE_NO_UID;
+    int cpu;
+
+    guard(raw_spinlock_irqsave)(&grp->gang_lock);
+
+    for_each_cpu_wrap(cpu, grp->cpus, grp->gang_cpu + 1) {
+        uid_t want = READ_ONCE(per_cpu(entangle_want_uid, cpu));
+
+        if (want != ENTANGLE_NO_UID && want != owner) {
+            next = want;
+            grp->gang_cpu = cpu;
+            break;
+        }
+    }
+
+    if (next == ENTANGLE_NO_UID) {
+        grp->gang_active = false;
+        return HRTIMER_NORESTART;
+    }
+
+    WRITE_ONCE(grp->owner, next);
+    for_each_cpu(cpu, grp->cpus)
+        irq_work_queue_on(&per_cpu(entangle_kick, cpu), cpu);
+
+    hrtimer_forward_now(timer, ns_to_ktime(grp->timeout_ns));
+    return HRTIMER_RESTART;
+}
+
+/* @cpu is forced idle waiting for @p's user: make sure the windows rotate */
+static void entangle_gang_wait(struct entangle_group *grp, int cpu, struct task_struct *p)
+{
+    WRITE_ONCE(per_cpu(entangle_want_uid, cpu), __kuid_val(task_uid(p)));
+
+    guard(raw_spinlock_irqsave)(&grp->gang_lock);
+    if (grp->gang_active)
+        return;
+
+    grp->gang_active = true;
+    hrtimer_start(&grp->gang_timer, ns_to_ktime(grp->timeout_ns), HRTIMER_MODE_REL_HARD);
+}
+
+/*
+ * The per-CPU uids the group decisions read. Always entangle_cpu_uids
+ * outside the KUnit tests, which pass their own so they never touch a
+ * live CPU's state.
+ */
+struct entangle_uids {
+    uid_t __percpu *curr;
+    uid_t __percpu *want;
+};
+
+static const struct entangle_uids entangle_cpu_uids = {
+    .curr = &entangle_curr_uid,
+    .want = &entangle_want_uid,
+};
+
+/* Does any CPU of @grp other than @cpu run or wait for user @uid? */
+static bool entangle_gang_busy(const struct entangle_group *grp, const struct entangle_uids *uids,
+                               int cpu, uid_t uid)
+{
+    int sibling_cpu;
+
+    for_each_cpu(sibling_cpu, grp->cpus) {
+        if (sibling_cpu == cpu)
+            continue;
+
+        if (READ_ONCE(*per_cpu_ptr(uids->want, sibling_cpu)) == uid ||
+            READ_ONCE(*per_cpu_ptr(uids->curr, sibling_cpu)) == uid)
+            return true;
+    }
+
+    return false;
+}
+
+static void entangle_free_config(struct entangle_config *cfg)
+{
+    unsigned int i;
+
+    if (!cfg)
+        return;
+
+    for (i = 0; i < cfg->nr_groups; i++) {
+        hrtimer_cancel(&cfg->groups[i].gang_timer);
+        kfree(cfg->groups[i].cpus);
+    }
+    kfree(cfg);
+}
+
+static struct entangle_config *entangle_alloc_config(unsigned int nr_groups)
+{
+    struct entangle_config *cfg;
+    unsigned int i;
+
+    cfg = kzalloc(struct_size(cfg, groups, nr_groups), GFP_KERNEL);
+    if (!cfg)
+        return NULL;
+
+    cfg->nr_groups = nr_groups;
+    // Everything entangle_free_config() looks at, before it can fail
+    for (i = 0; i < nr_groups; i++) {
+        struct entangle_group *grp = &cfg->groups[i];
+
+        grp->timeout_ns = ENTANGLE_DEFAULT_TIMEOUT_NS;
+        grp->owner = ENTANGLE_NO_UID;
+        raw_spin_lock_init(&grp->gang_lock);
+        hrtimer_init(&grp->gang_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        grp->gang_timer.function = entangle_gang_timer_fn;
+    }
+    for (i = 0; i < nr_groups; i++) {
+        cfg->groups[i].cpus = kzalloc(cpumask_size(), GFP_KERNEL);
+        if (!cfg->groups[i].cpus) {
+            entangle_free_config(cfg);
+            return NULL;
+        }
+    }
+    return cfg;
+}
+
+/* Forget the per-CPU pick state, only called with the hooks quiesced. */
+static void entangle_reset_state(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        WRITE_ONCE(per_cpu(entangle_forced, cpu), false);
+        WRITE_ONCE(per_cpu(entangle_class_blocked, cpu), false);
+        WRITE_ONCE(per_cpu(entangle_curr_uid, cpu), ENTANGLE_NO_UID);
+        WRITE_ONCE(per_cpu(entangle_want_uid, cpu), ENTANGLE_NO_UID);
+        per_cpu(entangle_last_uid, cpu) = ENTANGLE_NO_UID;
+        per_cpu(entangled_idle_start, cpu) = 0;
+        per_cpu(entangle_class_wait_start, cpu) = 0;
+    }
+}
+
+/*
+ * Publish @cfg (may be NULL) and repoint every CPU at its group. The old
+ * config is freed once no pick_next_task_fair() can still be looking at it.
+ * Flipping sched_entangle_key needs the hotplug lock, which every caller
+ * takes before entangle_mutex.
+ */
+static void entangle_install_config(struct entangle_config *cfg)
+{
+    struct entangle_config *old;
+    unsigned int i;
+    int cpu;
+
+    lockdep_assert_cpus_held();
+    lockdep_assert_held(&entangle_mutex);
+
+    for_each_possible_cpu(cpu)
+        RCU_INIT_POINTER(per_cpu(entangle_group, cpu), NULL);
+
+    if (cfg) {
+        for (i = 0; i < cfg->nr_groups; i++) {
+            for_each_cpu(cpu, cfg->groups[i].cpus)
+                rcu_assign_pointer(per_cpu(entangle_group, cpu), &cfg->groups[i]);
+        }
+    }
+
+    old = entangle_config;
+    entangle_config = cfg;
+
+    if (cfg && !old) {
+        // Nothing was published while the key was off
+        entangle_reset_state();
+        static_branch_enable_cpuslocked(&sched_entangle_key);
+    } else if (!cfg && old) {
+        static_branch_disable_cpuslocked(&sched_entangle_key);
+    }
+
+    synchronize_rcu();
+    // No pick is in the hooks anymore, drop what they left behind
+    if (!cfg && old)
+        entangle_reset_state();
+    entangle_free_config(old);
+}
+
+/* Parse a group's "strict", "timeout[=ms]", "alternate[=ms]" or "gang[=ms]" suffix. */
+static int entangle_parse_policy(char *str, struct entangle_group *grp)
+{
+    char *name = strsep(&str, "=");
+    unsigned int ms;
+    int ret;
+
+    if (!strcmp(name, "strict"))
+        grp->policy = ENTANGLE_STRICT;
+    else if (!strcmp(name, "timeout"))
+        grp->policy = ENTANGLE_TIMEOUT;
+    else if (!strcmp(name, "alternate"))
+        grp->policy = ENTANGLE_ALTERNATE;
+    else if (!strcmp(name, "gang"))
+        grp->policy = ENTANGLE_GANG;
+    else
+        return -EINVAL;
+
+    if (grp->policy == ENTANGLE_GANG)
+        grp->timeout_ns = ENTANGLE_DEFAULT_GANG_NS;
+
+    if (!str)
+        return 0;
+    // strict waits forever, a time makes no sense there
+    if (grp->policy == ENTANGLE_STRICT)
+        return -EINVAL;
+
+    ret = kstrtouint(str, 10, &ms);
+    if (ret)
+        return ret;
+    if (!ms)
+        return -EINVAL;
+
+    grp->timeout_ns = (u64)ms * NSEC_PER_MSEC;
+    return 0;
+}
+
+/*
+ * Parse "<cpulist>[:<policy>];<cpulist>[:<policy>];..." into a config.
+ * Groups must be disjoint and hold at least two CPUs; an empty string
+ * clears all groups.
+ */
+static int entangle_parse_groups(char *str, struct entangle_config **cfgp)
+{
+    struct entangle_config *cfg;
+    struct cpumask *seen;
+    unsigned int nr, i = 0;
+    char *s, *tok;
+    int ret = 0;
+
+    *cfgp = NULL;
+    str = strim(str);
+    if (!*str)
+        return 0;
+
+    nr = 1;
+    for (s = str; (s = strchr(s, ';')); s++)
+        nr++;
+
+    cfg = entangle_alloc_config(nr);
+    seen = kzalloc(cpumask_size(), GFP_KERNEL);
+    if (!cfg || !seen) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    while ((tok = strsep(&str, ";")) != NULL) {
+        struct cpumask *cpus = cfg->groups[i].cpus;
+        char *list = strsep(&tok, ":");
+
+        ret = cpulist_parse(strim(list), cpus);
+        if (ret)
+            goto out;
+
+        if (tok) {
+            ret = entangle_parse_policy(strim(tok), &cfg->groups[i]);
+            if (ret)
+                goto out;
+        }
+
+        if (cpumask_weight(cpus) < 2 || cpumask_intersects(cpus, seen) ||
+            !cpumask_subset(cpus, cpu_possible_mask)) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        cpumask_or(seen, seen, cpus);
+        i++;
+    }
+
+out:
+    kfree(seen);
+    if (ret)
+        entangle_free_config(cfg);
+    else
+        *cfgp = cfg;
+    return ret;
+}
+
+static int sched_entangled_pair_handler(const struct ctl_table *table, int write,
+                                        void *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct entangle_config *cfg = NULL;
+    struct ctl_table t = *table;
+    unsigned int *data = table->data;
+    unsigned int val, c1, c2;
+    int ret;
+
+    guard(cpus_read_lock)();
+    guard(mutex)(&entangle_mutex);
+
+    if (write && sysctl_entangled_cpus_smt)
+        return -EBUSY;
+
+    // Parse into a copy: the sysctl only changes once the config does
+    val = *data;
+    t.data = &val;
+    ret = proc_douintvec_minmax(&t, write, buffer, lenp, ppos);
+    if (ret || !write)
+        return ret;
+
+    c1 = data == &sysctl_entangled_cpu1 ? val : sysctl_entangled_cpu1;
+    c2 = data == &sysctl_entangled_cpu2 ? val : sysctl_entangled_cpu2;
+
+    // c1 == c2 disables entanglement, as before
+    if (c1 != c2) {
+        if (c1 >= nr_cpu_ids || c2 >= nr_cpu_ids)
+            return -EINVAL;
+
+        cfg = entangle_alloc_config(1);
+        if (!cfg)
+            return -ENOMEM;
+        cpumask_set_cpu(c1, cfg->groups[0].cpus);
+        cpumask_set_cpu(c2, cfg->groups[0].cpus);
+        snprintf(sysctl_entangled_cpu_groups, sizeof(sysctl_entangled_cpu_groups),
+                 "%u,%u", c1, c2);
+    } else {
+        sysctl_entangled_cpu_groups[0] = '\0';
+    }
+
+    *data = val;
+    entangle_install_config(cfg);
+    return 0;
+}
+
+static int sched_entangled_groups_handler(const struct ctl_table *table, int write,
+                                          void *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct ctl_table t = *table;
+    struct entangle_config *cfg;
+    char *kbuf, *str;
+    int ret;
+
+    guard(cpus_read_lock)();
+    guard(mutex)(&entangle_mutex);
+
+    if (!write)
+        return proc_dostring(table, write, buffer, lenp, ppos);
+
+    if (sysctl_entangled_cpus_smt)
+        return -EBUSY;
+
+    kbuf = kzalloc(table->maxlen, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+
+    t.data = kbuf;
+    ret = proc_dostring(&t, write, buffer, lenp, ppos);
+    if (ret)
+        goto out;
+
+    // Parsing chops the string up, keep kbuf intact for the readback
+    str = kstrdup(kbuf, GFP_KERNEL);
+    if (!str) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = entangle_parse_groups(str, &cfg);
+    kfree(str);
+    if (ret)
+        goto out;
+
+    strscpy(sysctl_entangled_cpu_groups, kbuf, sizeof(sysctl_entangled_cpu_groups));
+    // The legacy pair no longer describes the configuration
+    sysctl_entangled_cpu1 = sysctl_entangled_cpu2 = 0;
+    entangle_install_config(cfg);
+
+out:
+    kfree(kbuf);
+    return ret;
+}
+
+#ifdef CONFIG_SCHED_SMT
+/* Build one group per core from the online CPUs, leaving @dying_cpu out. */
+static int entangle_build_smt_config(int dying_cpu, struct entangle_config **cfgp)
+{
+    struct entangle_config *cfg = NULL;
+    cpumask_var_t online, done;
+    unsigned int nr = 0, i = 0;
+    int cpu, ret = 0;
+
+    if (!zalloc_cpumask_var(&online, GFP_KERNEL))
+        return -ENOMEM;
+    if (!zalloc_cpumask_var(&done, GFP_KERNEL)) {
+        free_cpumask_var(online);
+        return -ENOMEM;
+    }
+
+    cpumask_copy(online, cpu_online_mask);
+    if (dying_cpu >= 0)
+        __cpumask_clear_cpu(dying_cpu, online);
+
+    for_each_cpu(cpu, online) {
+        if (cpumask_test_cpu(cpu, done))
+            continue;
+        cpumask_or(done, done, cpu_smt_mask(cpu));
+        if (cpumask_weight_and(cpu_smt_mask(cpu), online) >= 2)
+            nr++;
+    }
+
+    if (nr) {
+        cfg = entangle_alloc_config(nr);
+        if (!cfg) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        cpumask_clear(done);
+        for_each_cpu(cpu, online) {
+            if (cpumask_test_cpu(cpu, done))
+                continue;
+            cpumask_or(done, done, cpu_smt_mask(cpu));
+            if (cpumask_weight_and(cpu_smt_mask(cpu), online) >= 2)
+                cpumask_and(cfg->groups[i++].cpus, cpu_smt_mask(cpu), online);
+        }
+    }
+
+    *cfgp = cfg;
+out:
+    free_cpumask_var(done);
+    free_cpumask_var(online);
+    return ret;
+}
+#else
+static int entangle_build_smt_config(int dying_cpu, struct entangle_config **cfgp)
+{
+    *cfgp = NULL;
+    return 0;
+}
+#endif /* CONFIG_SCHED_SMT */
+
+/* Reflect the installed groups back into entangled_cpu_groups. */
+static void entangle_format_groups(struct entangle_config *cfg)
+{
+    char *buf = sysctl_entangled_cpu_groups;
+    size_t len = sizeof(sysctl_entangled_cpu_groups);
+    int n = 0;
+    unsigned int i;
+
+    buf[0] = '\0';
+    for (i = 0; cfg && i < cfg->nr_groups; i++)
+        n += scnprintf(buf + n, len - n, "%s%*pbl", i ? ";" : "",
+                       cpumask_pr_args(cfg->groups[i].cpus));
+}
+
+static int entangle_rebuild_smt(int dying_cpu)
+{
+    struct entangle_config *cfg;
+    int ret;
+
+    lockdep_assert_held(&entangle_mutex);
+
+    ret = entangle_build_smt_config(dying_cpu, &cfg);
+    if (ret)
+        return ret;
+
+    entangle_format_groups(cfg);
+    sysctl_entangled_cpu1 = sysctl_entangled_cpu2 = 0;
+    entangle_install_config(cfg);
+    return 0;
+}
+
+static int sched_entangled_smt_handler(const struct ctl_table *table, int write,
+                                       void *buffer, size_t *lenp, loff_t *ppos)
+{
+    unsigned int old;
+    int ret;
+
+    // Same lock order as the hotplug callbacks below
+    guard(cpus_read_lock)();
+    guard(mutex)(&entangle_mutex);
+
+    old = sysctl_entangled_cpus_smt;
+    ret = proc_douintvec_minmax(table, write, buffer, lenp, ppos);
+    if (ret || !write || old == sysctl_entangled_cpus_smt)
+        return ret;
+
+    if (sysctl_entangled_cpus_smt) {
+        ret = entangle_rebuild_smt(-1);
+        if (ret)
+            sysctl_entangled_cpus_smt = old;
+        return ret;
+    }
+
+    // Leaving SMT mode drops the derived groups
+    sysctl_entangled_cpu_groups[0] = '\0';
+    entangle_install_config(NULL);
+    return 0;
+}
+
+/*
+ * Hotplug callbacks. The online state runs before sched_cpu_activate() and
+ * the teardown after sched_cpu_deactivate(), so the dying CPU is still in
+ * cpu_online_mask and has to be left out explicitly.
+ */
+static int entangle_cpu_online(unsigned int cpu)
+{
+    guard(mutex)(&entangle_mutex);
+
+    if (sysctl_entangled_cpus_smt)
+        return entangle_rebuild_smt(-1);
+    return 0;
+}
+
+static int entangle_cpu_offline(unsigned int cpu)
+{
+    guard(mutex)(&entangle_mutex);
+
+    if (sysctl_entangled_cpus_smt)
+        return entangle_rebuild_smt(cpu);
+    return 0;
+}
+
+static int __init entangle_hotplug_init(void)
+{
+    int ret;
+
+    ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "sched/entangle:online",
+                                    entangle_cpu_online, entangle_cpu_offline);
+    return ret < 0 ? ret : 0;
+}
+late_initcall(entangle_hotplug_init);
+
+#ifdef CONFIG_PROC_FS
+/*
+ * /proc/sched_entangle_stats: one line per possible CPU,
+ * "<cpu> <forced idle ns> <conflicts> <overrides>".
+ */
+static int entangle_stats_show(struct seq_file *m, void *v)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct entangle_stats *stats = per_cpu_ptr(&entangle_stats, cpu);
+
+        seq_printf(m, "%d %llu %llu %llu\n", cpu,
+                   (unsigned long long)READ_ONCE(stats->forced_idle_ns),
+                   (unsigned long long)READ_ONCE(stats->nr_conflicts),
+                   (unsigned long long)READ_ONCE(stats->nr_overrides));
+    }
+    return 0;
+}
+
+static int __init entangle_stats_proc_init(void)
+{
+    proc_create_single("sched_entangle_stats", 0444, NULL, entangle_stats_show);
+    return 0;
+}
+late_initcall(entangle_stats_proc_init);
+#endif /* CONFIG_PROC_FS */
+
+/*
+ * Does user @uid conflict with what the other CPUs of @grp, @cpu's
+ * entanglement group, are running? Called with @cpu's rq lock held, which
+ * keeps the group alive (see entangle_install_config()).
+ */
+static bool entangled_conflict(const struct entangle_group *grp, const struct entangle_uids *uids,
+                               int cpu, uid_t uid)
+{
+    int sibling_cpu;
+
+    for_each_cpu(sibling_cpu, grp->cpus) {
+        uid_t sibling_uid;
+
+        if (sibling_cpu == cpu)
+            continue;
+
+        /* A single load, no need to reach into the sibling's task */
+        sibling_uid = READ_ONCE(*per_cpu_ptr(uids->curr, sibling_cpu));
+        if (sibling_uid != ENTANGLE_NO_UID && sibling_uid != uid)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * The group policy as a pure function of the wait: a task that conflicts
+ * since @wait_start runs anyway from the returned instant on. U64_MAX for
+ * strict and gang groups, which only the kicks and gang_timer release.
+ * The fair pick, the core.c pick and the starvation timers all use it.
+ */
+static u64 entangle_wait_deadline(const struct entangle_group *grp, u64 wait_start)
+{
+    if (grp->policy == ENTANGLE_STRICT || grp->policy == ENTANGLE_GANG)
+        return U64_MAX;
+
+    return wait_start + grp->timeout_ns;
+}
+
+/*
+ * May user @uid not run on @cpu, a CPU of @grp, right now? On top of
+ * entangled_conflict(), which applies to everyone, a gang group refuses
+ * every user but its owner for as long as the owner still runs or waits
+ * on the group.
+ */
+static bool __entangle_blocked(const struct entangle_group *grp, const struct entangle_uids *uids,
+                               int cpu, uid_t uid)
+{
+    if (grp->policy == ENTANGLE_GANG) {
+        uid_t owner = READ_ONCE(grp->owner);
+
+        if (owner != ENTANGLE_NO_UID && owner != uid && entangle_gang_busy(grp, uids, cpu, owner))
+            return true;
+    }
+
+    // The owner too: right after a rotation the siblings still run the old one
+    return entangled_conflict(grp, uids, cpu, uid);
+}
+
+/* May @p not run on @cpu right now? */
+static bool entangle_blocked(int cpu, struct task_struct *p)
+{
+    struct entangle_group *grp;
+
+    if (!static_branch_unlikely(&sched_entangle_key))
+        return false;
+
+    grp = rcu_dereference_sched(per_cpu(entangle_group, cpu));
+    if (!grp)
+        return false;
+
+    return __entangle_blocked(grp, &entangle_cpu_uids, cpu, __kuid_val(task_uid(p)));
+}
+
+#ifdef CONFIG_SCHED_CORE
+/*
+ * entangled_cpus_cookie: instead of peeking at the siblings' current task,
+ * give every user its own core scheduling cookie. The core-wide pick in
+ * core.c then never co-schedules two users on one core, and
+ * sched_core_balance() steals cookie-matching tasks instead of idling.
+ * This covers SMT siblings only; the entanglement groups are not consulted
+ * while core scheduling is active, since pick_next_task_fair() is bypassed.
+ *
+ * The cookies are ordinary core_sched.c cookies, one per uid, and the
+ * table holds a reference on each for as long as the mode is on. They are
+ * allocated from a work item since that may sleep: a task whose user has
+ * no cookie yet runs without one and gets it once the work has run.
+ */
+#define ENTANGLE_MAX_COOKIES 256
+
+/* core_sched.c's cookie helpers, made non-static in this directory's core_sched.c */
+extern unsigned long sched_core_alloc_cookie(void);
+extern void sched_core_put_cookie(unsigned long cookie);
+extern unsigned long sched_core_get_cookie(unsigned long cookie);
+extern unsigned long sched_core_update_cookie(struct task_struct *p, unsigned long cookie);
+
+struct entangle_cookie {
+    kuid_t uid;
+    unsigned long cookie; // 0 until entangle_alloc_cookies() ran
+    bool is_active;
+};
+
+static unsigned int sysctl_entangled_cpus_cookie = 0;
+static struct entangle_cookie entangle_cookies[ENTANGLE_MAX_COOKIES];
+static DEFINE_RAW_SPINLOCK(entangle_cookies_lock);
+
+static void entangle_cookie_workfn(struct work_struct *work);
+static DECLARE_WORK(entangle_cookie_work, entangle_cookie_workfn);
+
+/* The enqueue path holds the rq lock, bounce through irq_work to queue the work */
+static void entangle_cookie_irq_workfn(struct irq_work *work)
+{
+    schedule_work(&entangle_cookie_work);
+}
+
+static struct irq_work entangle_cookie_irq_work =
+    IRQ_WORK_INIT(entangle_cookie_irq_workfn);
+
+static bool entangle_is_cookie(unsigned long cookie)
+{
+    int i;
+
+    for (i = 0; i < ENTANGLE_MAX_COOKIES; i++) {
+        if (smp_load_acquire(&entangle_cookies[i].is_active) &&
+            READ_ONCE(entangle_cookies[i].cookie) == cookie)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * @uid's cookie, or 0 if it has none yet: the slot is then reserved and
+ * the allocation queued. Also 0 if the table is full.
+ */
+static unsigned long entangle_uid_cookie(kuid_t uid)
+{
+    unsigned long flags, cookie;
+    int i, slot = -1;
+
+    for (i = 0; i < ENTANGLE_MAX_COOKIES; i++) {
+        if (smp_load_acquire(&entangle_cookies[i].is_active) &&
+            uid_eq(entangle_cookies[i].uid, uid)) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == -1) {
+        raw_spin_lock_irqsave(&entangle_cookies_lock, flags);
+        for (i = 0; i < ENTANGLE_MAX_COOKIES; i++) {
+            if (entangle_cookies[i].is_active) {
+                if (uid_eq(entangle_cookies[i].uid, uid)) {
+                    slot = i;
+                    break;
+                }
+            } else if (slot == -1) {
+                slot = i;
+            }
+        }
+        if (slot != -1 && !entangle_cookies[slot].is_active) {
+            entangle_cookies[slot].uid = uid;
+            entangle_cookies[slot].cookie = 0;
+            smp_store_release(&entangle_cookies[slot].is_active, true);
+        }
+        raw_spin_unlock_irqrestore(&entangle_cookies_lock, flags);
+        if (slot == -1)
+            return 0;
+    }
+
+    cookie = smp_load_acquire(&entangle_cookies[slot].cookie);
+    if (!cookie)
+        irq_work_queue(&entangle_cookie_irq_work);
+    return cookie;
+}
+
+/*
+ * The cookie @p should carry: its user's when the mode is on, none when it
+ * is off. Cookies set through prctl(PR_SCHED_CORE) are left alone.
+ */
+static bool entangle_wanted_cookie(struct task_struct *p, unsigned long *cookie)
+{
+    unsigned long old = p->core_cookie;
+
+    *cookie = READ_ONCE(sysctl_entangled_cpus_cookie) && !is_idle_task(p) ?
+              entangle_uid_cookie(task_uid(p)) : 0;
+    if (*cookie == old)
+        return false;
+
+    return !old || entangle_is_cookie(old);
+}
+
+/*
+ * Called from enqueue_task_fair(), before core.c's enqueue_task() adds the
+ * task to the core tree, so the cookie follows uid changes at the next
+ * wakeup. Only the cookie is swapped; the core tree is core.c's business.
+ * The old cookie is one of ours, so the table's reference keeps the put
+ * from freeing it under the rq lock.
+ */
+static void entangle_enqueue_cookie(struct rq *rq, struct task_struct *p)
+{
+    unsigned long cookie, old;
+
+    lockdep_assert_rq_held(rq);
+
+    if (sched_core_enqueued(p) || !entangle_wanted_cookie(p, &cookie))
+        return;
+
+    old = p->core_cookie;
+    p->core_cookie = cookie ? sched_core_get_cookie(cookie) : 0;
+    if (old)
+        sched_core_put_cookie(old);
+}
+
+/* Bring every existing task in line with the mode. */
+static void entangle_update_all_cookies(void)
+{
+    struct task_struct *g, *p;
+    unsigned long cookie;
+
+    rcu_read_lock();
+    for_each_process_thread(g, p) {
+        if (!entangle_wanted_cookie(p, &cookie))
+            continue;
+        if (cookie)
+            sched_core_get_cookie(cookie);
+        cookie = sched_core_update_cookie(p, cookie);
+        if (cookie)
+            sched_core_put_cookie(cookie);
+    }
+    rcu_read_unlock();
+}
+
+/* Allocate the cookies of the reserved slots; true if any was. */
+static bool entangle_alloc_cookies(void)
+{
+    unsigned long cookie;
+    bool done = false;
+    int i;
+
+    lockdep_assert_held(&entangle_mutex);
+
+    for (i = 0; i < ENTANGLE_MAX_COOKIES; i++) {
+        if (!smp_load_acquire(&entangle_cookies[i].is_active) ||
+            READ_ONCE(entangle_cookies[i].cookie))
+            continue;
+
+        cookie = sched_core_alloc_cookie();
+        if (!cookie)
+            break;
+        smp_store_release(&entangle_cookies[i].cookie, cookie);
+        done = true;
+    }
+    return done;
+}
+
+/*
+ * Drop the table's references, once no task carries our cookies any more.
+ * The mode is off, so the enqueue path no longer looks at the table.
+ */
+static void entangle_free_cookies(void)
+{
+    int i;
+
+    lockdep_assert_held(&entangle_mutex);
+
+    for (i = 0; i < ENTANGLE_MAX_COOKIES; i++) {
+        unsigned long cookie = entangle_cookies[i].cookie;
+
+        WRITE_ONCE(entangle_cookies[i].is_active, false);
+        WRITE_ONCE(entangle_cookies[i].cookie, 0);
+        if (cookie)
+            sched_core_put_cookie(cookie);
+    }
+}
+
+static void entangle_cookie_workfn(struct work_struct *work)
+{
+    guard(mutex)(&entangle_mutex);
+
+    if (READ_ONCE(sysctl_entangled_cpus_cookie) && entangle_alloc_cookies())
+        entangle_update_all_cookies();
+}
+
+static int sched_entangled_cookie_handler(const struct ctl_table *table, int write,
+                                          void *buffer, size_t *lenp, loff_t *ppos)
+{
+    bool keep = false;
+    unsigned int old;
+    int ret = 0;
+
+    /*
+     * Turning core scheduling on takes the hotplug lock, and the hotplug
+     * callbacks take entangle_mutex under it: get the reference the mode
+     * holds before the mutex. sched_core_put() defers the flip back to a
+     * work item, so dropping it under the mutex is fine.
+     */
+    if (write)
+        sched_core_get();
+
+    scoped_guard (mutex, &entangle_mutex) {
+        old = sysctl_entangled_cpus_cookie;
+        ret = proc_douintvec_minmax(table, write, buffer, lenp, ppos);
+        if (ret || !write || old == sysctl_entangled_cpus_cookie)
+            break;
+
+        if (sysctl_entangled_cpus_cookie) {
+            keep = true;
+            // The first pass reserves a slot per user, the second hands out cookies
+            entangle_update_all_cookies();
+            entangle_alloc_cookies();
+            entangle_update_all_cookies();
+        } else {
+            // Wait out enqueues that still saw the mode on before stripping
+            synchronize_rcu();
+            entangle_update_all_cookies();
+            entangle_free_cookies();
+            sched_core_put();
+        }
+    }
+
+    if (write && !keep)
+        sched_core_put();
+    return ret;
+}
+#else
+static inline void entangle_enqueue_cookie(struct rq *rq, struct task_struct *p) { }
+#endif /* CONFIG_SCHED_CORE */
 
 
 
@@ -166,15 +1179,51 @@ static struct ctl_table sched_fair_sysctls[] = {
 		.data = &sysctl_entangled_cpu1,
 		.maxlen = sizeof(unsigned int),
 		.mode = 0644,
-		.proc_handler = proc_dointvec_minmax,
+		.proc_handler = sched_entangled_pair_handler,
 	},
 	{
 		.procname = "entangled_cpus_2",
 		.data = &sysctl_entangled_cpu2,
 		.maxlen = sizeof(unsigned int),
 		.mode = 0644,
-		.proc_handler = proc_dointvec_minmax,
+		.proc_handler = sched_entangled_pair_handler,
+	},
+	{
+		.procname = "entangled_cpu_groups",
+		.data = sysctl_entangled_cpu_groups,
+		.maxlen = sizeof(sysctl_entangled_cpu_groups),
+		.mode = 0644,
+		.proc_handler = sched_entangled_groups_handler,
+	},
+	{
+		.procname = "entangled_cpus_smt",
+		.data = &sysctl_entangled_cpus_smt,
+		.maxlen = sizeof(unsigned int),
+		.mode = 0644,
+		.proc_handler = sched_entangled_smt_handler,
+		.extra1 = SYSCTL_ZERO,
+		.extra2 = SYSCTL_ONE,
+	},
+	{
+		.procname = "entangled_pick_scan",
+		.data = &sysctl_entangled_pick_scan,
+		.maxlen = sizeof(unsigned int),
+		.mode = 0644,
+		.proc_handler = proc_douintvec_minmax,
+		.extra1 = SYSCTL_ZERO,
+		.extra2 = &sysctl_entangled_pick_scan_max,
+	},
+#ifdef CONFIG_SCHED_CORE
+	{
+		.procname = "entangled_cpus_cookie",
+		.data = &sysctl_entangled_cpus_cookie,
+		.maxlen = sizeof(unsigned int),
+		.mode = 0644,
+		.proc_handler = sched_entangled_cookie_handler,
+		.extra1 = SYSCTL_ZERO,
+		.extra2 = SYSCTL_ONE,
 	},
+#endif
 };
 
 
@@ -7036,6 +8085,10 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	if (!(p->se.sched_delayed && (task_on_rq_migrating(p) || (flags & ENQUEUE_RESTORE))))
 		util_est_enqueue(&rq->cfs, p);
 
+	/* --- BEGIN TASK 1: PER-USER CORE COOKIE --- */
+	entangle_enqueue_cookie(rq, p);
+	/* --- END TASK 1 MODIFICATION --- */
+
 	if (flags & ENQUEUE_DELAYED) {
 		requeue_delayed_entity(se);
 		return;
@@ -7657,9 +8710,19 @@ static inline int sched_balance_find_dst_cpu(struct sched_domain *sd, struct tas
 	return new_cpu;
 }
 
+/*
+ * An idle CPU is only worth waking @p on if its entanglement group would
+ * not force it idle right away; otherwise keep looking for a CPU whose
+ * group is idle or runs @p's user.
+ */
+static inline bool entangle_idle_cpu(int cpu, struct task_struct *p)
+{
+    return (available_idle_cpu(cpu) || sched_idle_cpu(cpu)) && !entangle_blocked(cpu, p);
+}
+
 static inline int __select_idle_cpu(int cpu, struct task_struct *p)
 {
-	if ((available_idle_cpu(cpu) || sched_idle_cpu(cpu)) &&
+	if (entangle_idle_cpu(cpu, p) &&
 	    sched_cpu_cookie_match(cpu_rq(cpu), p))
 		return cpu;
 
@@ -7745,7 +8808,7 @@ static int select_idle_core(struct task_struct *p, int core, struct cpumask *cpu
 			*idle_cpu = cpu;
 	}
 
-	if (idle)
+	if (idle && !entangle_blocked(core, p))
 		return core;
 
 	cpumask_andnot(cpus, cpus, cpu_smt_mask(core));
@@ -7768,7 +8831,7 @@ static int select_idle_smt(struct task_struct *p, struct sched_domain *sd, int t
 		 */
 		if (!cpumask_test_cpu(cpu, sched_domain_span(sd)))
 			continue;
-		if (available_idle_cpu(cpu) || sched_idle_cpu(cpu))
+		if (entangle_idle_cpu(cpu, p))
 			return cpu;
 	}
 
@@ -7890,7 +8953,7 @@ select_idle_capacity(struct task_struct *p, struct sched_domain *sd, int target)
 	for_each_cpu_wrap(cpu, cpus, target) {
 		unsigned long cpu_cap = capacity_of(cpu);
 
-		if (!available_idle_cpu(cpu) && !sched_idle_cpu(cpu))
+		if (!entangle_idle_cpu(cpu, p))
 			continue;
 
 		fits = util_fits_cpu(task_util, util_min, util_max, cpu);
@@ -7961,7 +9024,7 @@ static int select_idle_sibling(struct task_struct *p, int prev, int target)
 	 */
 	lockdep_assert_irqs_disabled();
 
-	if ((available_idle_cpu(target) || sched_idle_cpu(target)) &&
+	if (entangle_idle_cpu(target, p) &&
 	    asym_fits_cpu(task_util, util_min, util_max, target))
 		return target;
 
@@ -7969,7 +9032,7 @@ static int select_idle_sibling(struct task_struct *p, int prev, int target)
 	 * If the previous CPU is cache affine and idle, don't be stupid:
 	 */
 	if (prev != target && cpus_share_cache(prev, target) &&
-	    (available_idle_cpu(prev) || sched_idle_cpu(prev)) &&
+	    entangle_idle_cpu(prev, p) &&
 	    asym_fits_cpu(task_util, util_min, util_max, prev)) {
 
 		if (!static_branch_unlikely(&sched_cluster_active) ||
@@ -8001,7 +9064,7 @@ static int select_idle_sibling(struct task_struct *p, int prev, int target)
 	if (recent_used_cpu != prev &&
 	    recent_used_cpu != target &&
 	    cpus_share_cache(recent_used_cpu, target) &&
-	    (available_idle_cpu(recent_used_cpu) || sched_idle_cpu(recent_used_cpu)) &&
+	    entangle_idle_cpu(recent_used_cpu, p) &&
 	    cpumask_test_cpu(recent_used_cpu, p->cpus_ptr) &&
 	    asym_fits_cpu(task_util, util_min, util_max, recent_used_cpu)) {
 
@@ -8980,59 +10043,391 @@ again:
 static void __set_next_task_fair(struct rq *rq, struct task_struct *p, bool first);
 static void set_next_task_fair(struct rq *rq, struct task_struct *p, bool first);
 
+static enum hrtimer_restart entangle_timer_fn(struct hrtimer *timer)
+{
+    resched_cpu(smp_processor_id());
+    return HRTIMER_NORESTART;
+}
+
+static void entangle_kick_fn(struct irq_work *work)
+{
+    resched_cpu(smp_processor_id());
+}
+
+static void entangle_init_cpu(int cpu)
+{
+    hrtimer_init(&per_cpu(entangle_timer, cpu), CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+    per_cpu(entangle_timer, cpu).function = entangle_timer_fn;
+    hrtimer_init(&per_cpu(entangle_class_timer, cpu), CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+    per_cpu(entangle_class_timer, cpu).function = entangle_timer_fn;
+    per_cpu(entangle_kick, cpu) = IRQ_WORK_INIT_HARD(entangle_kick_fn);
+}
+
+#ifdef CONFIG_SMP
+static DEFINE_PER_CPU(struct balance_callback, entangle_kick_head);
+
+/*
+ * Runs after the context switch, so entangle_curr_uid already holds the new
+ * user when the forced idle siblings look at it again. After an alternate takeover
+ * the siblings still running the other user are kicked as well, so they
+ * start waiting for their own slice.
+ */
+static void entangle_kick_siblings(struct rq *rq)
+{
+    int cpu = cpu_of(rq);
+    struct entangle_group *grp = rcu_dereference_sched(per_cpu(entangle_group, cpu));
+    bool all = per_cpu(entangle_kick_all, cpu);
+    int sibling_cpu;
+
+    per_cpu(entangle_kick_all, cpu) = false;
+    if (!grp)
+        return;
+
+    for_each_cpu(sibling_cpu, grp->cpus) {
+        if (sibling_cpu == cpu)
+            continue;
+        if (all || READ_ONCE(per_cpu(entangle_forced, sibling_cpu)) ||
+            READ_ONCE(per_cpu(entangle_class_blocked, sibling_cpu)))
+            irq_work_queue_on(&per_cpu(entangle_kick, sibling_cpu), sibling_cpu);
+    }
+}
+#endif
+
+/*
+ * Bookkeeping at the end of the entangled pick: arm or cancel this CPU's
+ * starvation timer and, if the user running here changes, kick the forced
+ * idle CPUs of the group. @p is NULL when the CPU goes idle, @takeover is
+ * set when an alternate slice just ran out, and @grp is only dereferenced
+ * when @forced. Strict and gang groups have no deadline here, they wait for
+ * the kicks (and gang_timer).
+ */
+static void entangle_note_pick(struct rq *rq, struct entangle_group *grp,
+                               struct task_struct *p, bool forced, bool takeover)
+{
+    int cpu = cpu_of(rq);
+    uid_t uid = p ? __kuid_val(task_uid(p)) : ENTANGLE_NO_UID;
+    struct hrtimer *timer = &per_cpu(entangle_timer, cpu);
+    struct entangle_stats *stats = per_cpu_ptr(&entangle_stats, cpu);
+    bool was_forced = per_cpu(entangle_forced, cpu);
+    u64 deadline;
+
+    if (forced && !was_forced)
+        stats->forced_start = rq_clock(rq);
+    else if (!forced && was_forced)
+        WRITE_ONCE(stats->forced_idle_ns,
+                   stats->forced_idle_ns + rq_clock(rq) - stats->forced_start);
+
+    WRITE_ONCE(per_cpu(entangle_forced, cpu), forced);
+
+    if (!forced) {
+        WRITE_ONCE(per_cpu(entangle_want_uid, cpu), ENTANGLE_NO_UID);
+        // Nobody else wants the gang group, whoever runs here owns it
+        if (p && grp && grp->policy == ENTANGLE_GANG && READ_ONCE(grp->owner) != uid)
+            WRITE_ONCE(grp->owner, uid);
+    }
+
+    deadline = forced ? entangle_wait_deadline(grp, per_cpu(entangled_idle_start, cpu)) : U64_MAX;
+    if (deadline != U64_MAX) {
+        u64 now = rq_clock(rq);
+
+        hrtimer_start(timer, ns_to_ktime(deadline > now ? deadline - now : 0),
+                      HRTIMER_MODE_REL_PINNED_HARD);
+    } else if (hrtimer_active(timer)) {
+        // Can't wait for the callback here, it takes our rq lock
+        hrtimer_try_to_cancel(timer);
+    }
+
+    if (takeover)
+        per_cpu(entangle_kick_all, cpu) = true;
+    else if (per_cpu(entangle_last_uid, cpu) == uid)
+        return;
+    per_cpu(entangle_last_uid, cpu) = uid;
+
+#ifdef CONFIG_SMP
+    /*
+     * Also from the class loop pick, which has no rq_flags: __schedule()
+     * runs the balance callbacks after either pick.
+     */
+    if (rcu_access_pointer(per_cpu(entangle_group, cpu)))
+        queue_balance_callback(rq, &per_cpu(entangle_kick_head, cpu),
+                               entangle_kick_siblings);
+#endif
+}
+
+/*
+ * pick_task_fair() only returns the best entity. When its task conflicts,
+ * look for the best eligible task that doesn't: the running task first (it
+ * is not in the tree), then the tree in deadline order, i.e. the order
+ * pick_eevdf() prefers. Group entities are resolved to their own
+ * pick_eevdf() choice. At most sysctl_entangled_pick_scan entities are
+ * examined, so the cost stays bounded however long the runqueue is.
+ */
+static struct task_struct *entangle_pick_compatible(struct rq *rq)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    unsigned int budget = READ_ONCE(sysctl_entangled_pick_scan);
+    struct sched_entity *curr = cfs_rq->curr;
+    struct rb_node *node;
+    int cpu = cpu_of(rq);
+
+    if (curr && curr->on_rq && entity_is_task(curr) &&
+        entity_eligible(cfs_rq, curr) && !entangle_blocked(cpu, task_of(curr)))
+        return task_of(curr);
+
+    node = rb_first_cached(&cfs_rq->tasks_timeline);
+    for (; node && budget; node = rb_next(node), budget--) {
+        struct sched_entity *se = __node_2_se(node);
+
+        if (!entity_eligible(cfs_rq, se))
+            continue;
+
+        while (se && !entity_is_task(se))
+            se = pick_eevdf(group_cfs_rq(se));
+
+        if (!se || se->sched_delayed)
+            continue;
+
+        if (!entangle_blocked(cpu, task_of(se)))
+            return task_of(se);
+    }
+
+    return NULL;
+}
+
+#ifdef CONFIG_SMP
+/*
+ * Forced idle is wasted time if another runqueue nearby has a queued task
+ * that would not conflict here. Like steal_cookie_task() in core.c, a CPU
+ * that just went forced idle pulls one such task after the context switch,
+ * from a balance callback, walking its sched domains outwards.
+ */
+static DEFINE_PER_CPU(struct balance_callback, entangle_balance_head);
+
+static bool entangle_try_steal(int this, int that)
+{
+    struct rq *dst = cpu_rq(this), *src = cpu_rq(that);
+    struct task_struct *p;
+
+    guard(irq)();
+    guard(double_rq_lock)(dst, src);
+
+    // Someone else already gave us work
+    if (dst->curr != dst->idle)
+        return false;
+
+    // Leave the source at least the task it is running, if it runs any
+    if (src->cfs.h_nr_queued <= !READ_ONCE(per_cpu(entangle_forced, that)))
+        return false;
+
+    list_for_each_entry(p, &src->cfs_tasks, se.group_node) {
+        if (task_on_cpu(src, p) || p->se.sched_delayed)
+            continue;
+
+        if (!cpumask_test_cpu(this, p->cpus_ptr) ||
+            kthread_is_per_cpu(p) || is_migration_disabled(p))
+            continue;
+
+        if (throttled_lb_pair(task_group(p), that, this))
+            continue;
+
+        if (entangle_blocked(this, p))
+            continue;
+
+        deactivate_task(src, p, 0);
+        set_task_cpu(p, this);
+        activate_task(dst, p, 0);
+
+        resched_curr(dst);
+        return true;
+    }
+
+    return false;
+}
+
+static void entangle_balance(struct rq *rq)
+{
+    struct sched_domain *sd;
+    int cpu = cpu_of(rq);
+    int i;
+
+    guard(preempt)();
+    guard(rcu)();
+
+    raw_spin_rq_unlock_irq(rq);
+    for_each_domain(cpu, sd) {
+        for_each_cpu_wrap(i, sched_domain_span(sd), cpu + 1) {
+            if (i == cpu)
+                continue;
+
+            if (need_resched())
+                goto out;
+
+            if (entangle_try_steal(cpu, i))
+                goto out;
+        }
+    }
+out:
+    raw_spin_rq_lock_irq(rq);
+}
+
+static void queue_entangle_balance(struct rq *rq)
+{
+    queue_balance_callback(rq, &per_cpu(entangle_balance_head, cpu_of(rq)),
+                           entangle_balance);
+}
+#else
+static inline void queue_entangle_balance(struct rq *rq) { }
+#endif /* CONFIG_SMP */
+
+/*
+ * The core.c pick calls this for the tasks of every class but fair (and
+ * fair tasks picked through fair_server), which never reach the check in
+ * pick_next_task_fair(). Applies the group policy the same way: refuse
+ * until the timeout, never for strict, until handed the group for gang.
+ */
+bool entangle_pick_allowed(struct rq *rq, struct task_struct *p)
+{
+    int cpu = cpu_of(rq);
+    struct entangle_group *grp = rcu_dereference_sched(per_cpu(entangle_group, cpu));
+    u64 *wait_start = per_cpu_ptr(&entangle_class_wait_start, cpu);
+    struct entangle_stats *stats = per_cpu_ptr(&entangle_stats, cpu);
+    struct hrtimer *timer = &per_cpu(entangle_class_timer, cpu);
+    u64 now, deadline;
+
+    // The stopper has to run wherever it is, and idle never conflicts
+    if (!grp || is_idle_task(p) || p->sched_class == &stop_sched_class ||
+        !entangle_blocked(cpu, p))
+        goto allow;
+
+    now = rq_clock(rq);
+    if (!*wait_start)
+        *wait_start = now;
+
+    WRITE_ONCE(stats->nr_conflicts, stats->nr_conflicts + 1);
+    deadline = entangle_wait_deadline(grp, *wait_start);
+    if (now >= deadline) {
+        trace_entangle_conflict(cpu, p, false);
+        trace_entangle_override(cpu, p, now - *wait_start);
+        WRITE_ONCE(stats->nr_overrides, stats->nr_overrides + 1);
+        goto allow;
+    }
+
+    if (grp->policy == ENTANGLE_GANG)
+        entangle_gang_wait(grp, cpu, p);
+    else if (deadline != U64_MAX)
+        hrtimer_start(timer, ns_to_ktime(deadline - now), HRTIMER_MODE_REL_PINNED_HARD);
+
+    trace_entangle_conflict(cpu, p, true);
+    WRITE_ONCE(per_cpu(entangle_class_blocked, cpu), true);
+    return false;
+
+allow:
+    *wait_start = 0;
+    if (per_cpu(entangle_class_blocked, cpu)) {
+        WRITE_ONCE(per_cpu(entangle_class_blocked, cpu), false);
+        // Can't wait for the callback here, it takes our rq lock
+        hrtimer_try_to_cancel(timer);
+    }
+    return true;
+}
+
+/*
+ * @p of another class was picked and is now current: publish its user and
+ * do the same bookkeeping as the end of the fair pick. A forced idle
+ * pick_next_task_fair() ends up in the idle class too, having done all of
+ * it already.
+ */
+void entangle_class_picked(struct rq *rq, struct task_struct *p)
+{
+    int cpu = cpu_of(rq);
+    struct entangle_group *grp = rcu_dereference_sched(per_cpu(entangle_group, cpu));
+
+    if (p->sched_class == &stop_sched_class)
+        return;
+
+    if (is_idle_task(p)) {
+        WRITE_ONCE(per_cpu(entangle_curr_uid, cpu), ENTANGLE_NO_UID);
+        if (!per_cpu(entangle_forced, cpu))
+            entangle_note_pick(rq, grp, NULL, false, false);
+        return;
+    }
+
+    WRITE_ONCE(per_cpu(entangle_curr_uid, cpu), __kuid_val(task_uid(p)));
+    entangle_note_pick(rq, grp, p, false, false);
+}
+
 struct task_struct *
 pick_next_task_fair(struct rq *rq, struct task_struct *prev, struct rq_flags *rf)
 {
     struct sched_entity *se;
     struct task_struct *p;
+    bool entangle_forced_idle = false;
+    bool entangle_takeover = false;
+    struct entangle_group *grp;
     int new_tasks;
 
 again:
     p = pick_task_fair(rq);
 
     /* --- BEGIN TASK 1 MODIFICATION --- */
+    /* Patched out entirely while no entanglement group exists */
+    if (!static_branch_unlikely(&sched_entangle_key))
+        goto entangle_done;
+
+    grp = rcu_dereference_sched(per_cpu(entangle_group, cpu_of(rq)));
     if (p) {
         int cpu = cpu_of(rq);
-        int c1 = READ_ONCE(sysctl_entangled_cpu1);
-        int c2 = READ_ONCE(sysctl_entangled_cpu2);
-
-        /* Check if entanglement is active and we are on an entangled CPU */
-        if (c1 != c2 && (cpu == c1 || cpu == c2)) {
-            int sibling_cpu = (cpu == c1) ? c2 : c1;
-            struct rq *sibling_rq = cpu_rq(sibling_cpu);
-            
-            /* Locklessly read the sibling's current task */
-            struct task_struct *sibling_curr = READ_ONCE(sibling_rq->curr);
-
-            if (sibling_curr && sibling_curr->pid != 0 && 
-                !uid_eq(task_uid(p), task_uid(sibling_curr))) {
-                
-                /* Conflict detected! Check our starvation timer. */
-                u64 now = ktime_get_ns();
-                
-                if (entangled_idle_start[cpu] == 0) {
-                    /* First time we are blocking a task. Start the clock. */
-                    entangled_idle_start[cpu] = now;
-                }
+        u64 *idle_start = per_cpu_ptr(&entangled_idle_start, cpu);
+        /* Check if we are on an entangled CPU and conflict with our group */
+        bool conflict = grp && entangle_blocked(cpu, p);
 
-                /* 10 seconds = 10ULL * 1,000,000,000 ns */
-                if (now - entangled_idle_start[cpu] < 10000000000ULL) {
-                    /* Less than 10 seconds have passed. Force idle. */
-                    p = NULL; 
-                } else {
-                    /* Starvation timeout reached! Break the rule and let it run.
-                     * We must also reset the timer since we are no longer idle. */
-                    entangled_idle_start[cpu] = 0;
-                }
+        if (conflict) {
+            /* Maybe a compatible task is queued right behind it */
+            struct task_struct *alt = entangle_pick_compatible(rq);
+
+            if (alt) {
+                p = alt;
+                conflict = false;
+            }
+        }
+
+        if (conflict) {
+            struct entangle_stats *stats = per_cpu_ptr(&entangle_stats, cpu);
+            /* Conflict detected! Check our starvation timer. */
+            /* __schedule() just updated rq_clock(), no clocksource read needed */
+            u64 now = rq_clock(rq);
+
+            if (*idle_start == 0) {
+                /* First time we are blocking a task. Start the clock. */
+                *idle_start = now;
+            }
+
+            WRITE_ONCE(stats->nr_conflicts, stats->nr_conflicts + 1);
+            if (now < entangle_wait_deadline(grp, *idle_start)) {
+                /* Still within the group's timeout (strict and gang groups
+                 * have none). Force idle. */
+                trace_entangle_conflict(cpu, p, true);
+                if (grp->policy == ENTANGLE_GANG)
+                    entangle_gang_wait(grp, cpu, p);
+                p = NULL; 
+                entangle_forced_idle = true;
             } else {
-                /* No conflict! The task can run safely. Reset the timer. */
-                entangled_idle_start[cpu] = 0;
+                /* Starvation timeout reached! Break the rule and let it run.
+                 * We must also reset the timer since we are no longer idle. */
+                trace_entangle_conflict(cpu, p, false);
+                trace_entangle_override(cpu, p, now - *idle_start);
+                WRITE_ONCE(stats->nr_overrides, stats->nr_overrides + 1);
+                *idle_start = 0;
+                /* Alternating: the other user now waits for its slice */
+                entangle_takeover = grp->policy == ENTANGLE_ALTERNATE;
             }
         } else {
-            /* Not an entangled CPU, reset timer just in case. */
-            entangled_idle_start[cpu] = 0;
+            /* No conflict (or not entangled)! The task can run safely. Reset the timer. */
+            *idle_start = 0;
         }
     }
+    entangle_note_pick(rq, grp, p, entangle_forced_idle, entangle_takeover);
+entangle_done:
     /* --- END TASK 1 MODIFICATION --- */
 
     if (!p)
@@ -9088,7 +10483,15 @@ simple:
 	return p;
 
 idle:
-	if (rf) {
+	/*
+	 * A forced idle CPU still has queued tasks, so newidle balancing would
+	 * report them as pulled and send us straight back into the conflict.
+	 * Steal a compatible task once we are idle instead.
+	 */
+	if (entangle_forced_idle) {
+		if (rf)
+			queue_entangle_balance(rq);
+	} else if (rf) {
 		new_tasks = sched_balance_newidle(rq, rf);
 
 		/*
@@ -9149,6 +10552,11 @@ static void put_prev_task_fair(struct rq *rq, struct task_struct *prev, struct t
 		cfs_rq = cfs_rq_of(se);
 		put_prev_entity(cfs_rq, se);
 	}
+
+	/* --- BEGIN TASK 1: PUBLISH RUNNING UID --- */
+	if (static_branch_unlikely(&sched_entangle_key))
+		WRITE_ONCE(per_cpu(entangle_curr_uid, cpu_of(rq)), ENTANGLE_NO_UID);
+	/* --- END TASK 1 MODIFICATION --- */
 }
 
 /*
@@ -9579,6 +10987,15 @@ int can_migrate_task(struct task_struct *p, struct lb_env *env)
 		return 0;
 	}
 
+	/*
+	 * An entanglement conflict on dst_cpu would only force it idle there.
+	 * Treat it like affinity: if every task conflicts, the source counts
+	 * as all pinned rather than as a failed balance that escalates to
+	 * active balancing.
+	 */
+	if (entangle_blocked(env->dst_cpu, p))
+		return 0;
+
 	/* Record that we found at least one task that could run on dst_cpu */
 	env->flags &= ~LBF_ALL_PINNED;
 
@@ -9597,6 +11014,11 @@ int can_migrate_task(struct task_struct *p, struct lb_env *env)
 	if (env->flags & LBF_ACTIVE_LB)
 		return 1;
 
+	/* A task stalled behind a conflict on its CPU is never cache hot */
+	if (READ_ONCE(per_cpu(entangle_forced, env->src_cpu)) &&
+	    entangle_blocked(env->src_cpu, p))
+		return 1;
+
 	tsk_cache_hot = migrate_degrades_locality(p, env);
 	if (tsk_cache_hot == -1)
 		tsk_cache_hot = task_hot(p, env);
@@ -9672,6 +11094,8 @@ static int detach_tasks(struct lb_env *env)
 	unsigned long util, load;
 	struct task_struct *p;
 	int detached = 0;
+	/* A forced idle source runs none of its tasks, it can give up all */
+	unsigned int keep = !READ_ONCE(per_cpu(entangle_forced, env->src_cpu));
 
 	lockdep_assert_rq_held(env->src_rq);
 
@@ -9679,7 +11103,7 @@ static int detach_tasks(struct lb_env *env)
 	 * Source run queue has been emptied by another CPU, clear
 	 * LBF_ALL_PINNED flag as we will not test any task.
 	 */
-	if (env->src_rq->nr_running <= 1) {
+	if (env->src_rq->nr_running <= keep) {
 		env->flags &= ~LBF_ALL_PINNED;
 		return 0;
 	}
@@ -9692,7 +11116,7 @@ static int detach_tasks(struct lb_env *env)
 		 * We don't want to steal all, otherwise we may be treated likewise,
 		 * which could at worst lead to a livelock crash.
 		 */
-		if (env->idle && env->src_rq->nr_running <= 1)
+		if (env->idle && env->src_rq->nr_running <= keep)
 			break;
 
 		env->loop++;
@@ -10055,6 +11479,7 @@ struct sg_lb_stats {
 	unsigned int sum_nr_running;		/* Nr of all tasks running in the group */
 	unsigned int sum_h_nr_running;		/* Nr of CFS tasks running in the group */
 	unsigned int idle_cpus;                 /* Nr of idle CPUs         in the group */
+	unsigned int forced_idle_cpus;		/* Nr of CPUs forced idle by entanglement */
 	unsigned int group_weight;
 	enum group_type group_type;
 	unsigned int group_asym_packing;	/* Tasks should be moved to preferred CPU */
@@ -10505,6 +11930,16 @@ static inline void update_sg_lb_stats(struct lb_env *env,
 		if (nr_running > 1)
 			*sg_overloaded = 1;
 
+		/*
+		 * A forced idle CPU looks busy but none of its tasks run. Count
+		 * it apart, and flag overload so that idle CPUs keep doing
+		 * newidle balancing and can take its stalled tasks.
+		 */
+		if (READ_ONCE(per_cpu(entangle_forced, i)) && rq->cfs.h_nr_queued) {
+			sgs->forced_idle_cpus++;
+			*sg_overloaded = 1;
+		}
+
 		if (cpu_overutilized(i))
 			*sg_overutilized = 1;
 
@@ -10679,6 +12114,10 @@ static bool update_sd_pick_busiest(struct lb_env *env,
 		}
 has_spare:
 
+		/* Stalled tasks on forced idle CPUs gain the most from moving */
+		if (sgs->forced_idle_cpus != busiest->forced_idle_cpus)
+			return sgs->forced_idle_cpus > busiest->forced_idle_cpus;
+
 		/*
 		 * Select not overloaded group with lowest number of idle CPUs
 		 * and highest number of running tasks. We could also compare
@@ -11671,6 +13110,10 @@ static struct rq *sched_balance_find_src_rq(struct lb_env *env,
 			break;
 
 		case migrate_task:
+			/* None of a forced idle CPU's tasks run, rank it one up */
+			if (READ_ONCE(per_cpu(entangle_forced, i)))
+				nr_running++;
+
 			if (busiest_nr < nr_running) {
 				busiest_nr = nr_running;
 				busiest = rq;
@@ -13432,6 +14875,11 @@ static void __set_next_task_fair(struct rq *rq, struct task_struct *p, bool firs
 		list_move(&se->group_node, &rq->cfs_tasks);
 	}
 #endif
+	/* --- BEGIN TASK 1: PUBLISH RUNNING UID --- */
+	if (static_branch_unlikely(&sched_entangle_key))
+		WRITE_ONCE(per_cpu(entangle_curr_uid, cpu_of(rq)), __kuid_val(task_uid(p)));
+	/* --- END TASK 1 MODIFICATION --- */
+
 	if (!first)
 		return;
 
@@ -13868,9 +15316,12 @@ void show_numa_stats(struct task_struct *p, struct seq_file *m)
 
 __init void init_sched_fair_class(void)
 {
-#ifdef CONFIG_SMP
 	int i;
 
+	for_each_possible_cpu(i)
+		entangle_init_cpu(i);
+
+#ifdef CONFIG_SMP
 	for_each_possible_cpu(i) {
 		zalloc_cpumask_var_node(&per_cpu(load_balance_mask, i), GFP_KERNEL, cpu_to_node(i));
 		zalloc_cpumask_var_node(&per_cpu(select_rq_mask,    i), GFP_KERNEL, cpu_to_node(i));
@@ -13893,3 +15344,7 @@ __init void init_sched_fair_class(void)
 #endif /* SMP */
 
 }
+
+#if IS_BUILTIN(CONFIG_KUNIT)
+#include "entangle_test.c"
+#endif
@@ -15,6 +15,8 @@
 #define MAX_PATH 256
 #define MAX_PIDS 32768
 #define MAX_USERS 1024
+#define WAIT_BUCKETS 24
+#define WAIT_PROC "/proc/sched_user_wait"
 
 // Data Structures
 typedef struct {
@@ -29,6 +31,12 @@ typedef struct {
     double total_cpu_ms;
 } UserRecord;
 
+// One line of /proc/sched_user_wait: log2 buckets of 1024 ns units
+typedef struct {
+    uid_t uid;
+    unsigned long long buckets[WAIT_BUCKETS];
+} WaitRecord;
+
 // Global State
 ProcessRecord *tracked_procs;
 int num_tracked = 0;
@@ -37,6 +45,9 @@ int num_users = 0;
 long clk_tck;
 double monitor_start_uptime;
 int keep_running = 1;
+int report_wait = 0;
+WaitRecord *wait_start;
+int num_wait_start = 0;
 
 // Prototypes
 void cleanup(int sig);
@@ -47,11 +58,21 @@ int get_uid(int pid, uid_t *uid);
 void add_to_user(uid_t uid, double ms);
 int compare_users(const void *a, const void *b);
 void print_ranking(void);
+int read_wait_hist(WaitRecord *recs, int max);
+int wait_percentile(const unsigned long long *buckets, unsigned long long total, int pct);
+void print_wait_bound(int b);
+void print_wait_latency(void);
 
 int main(int argc, char *argv[]) {
     // 1. Parse Arguments
+    // -l adds the runqueue wait percentiles from the Task2B kernel
+    if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+        report_wait = 1;
+        argv++;
+        argc--;
+    }
     if (argc != 2) {
-        fprintf(stderr, "Usage: %s <seconds>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-l] <seconds>\n", argv[0]);
         return 1;
     }
     int duration = atoi(argv[1]);
@@ -76,6 +97,15 @@ int main(int argc, char *argv[]) {
     }
     memset(users, 0, MAX_USERS * sizeof(UserRecord));
 
+    if (report_wait) {
+        wait_start = malloc(MAX_USERS * sizeof(WaitRecord));
+        if (!wait_start) {
+            perror("malloc");
+            return 1;
+        }
+        num_wait_start = read_wait_hist(wait_start, MAX_USERS);
+    }
+
     // Handle interrupts gracefully
     signal(SIGINT, cleanup);
 
@@ -167,10 +197,13 @@ int main(int argc, char *argv[]) {
 
     // 3. Print Final Output
     print_ranking();
+    if (report_wait)
+        print_wait_latency();
     
     // Cleanup
     free(tracked_procs);
     free(users);
+    free(wait_start);
     return 0;
 }
 
@@ -303,3 +336,85 @@ void print_ranking(void) {
     }
 }
 
+// Returns the number of users read, or -1 if the kernel doesn't export it
+int read_wait_hist(WaitRecord *recs, int max) {
+    FILE *f = fopen(WAIT_PROC, "r");
+    int n = 0;
+    if (!f) return -1;
+
+    while (n < max && fscanf(f, "%u", &recs[n].uid) == 1) {
+        int b;
+        for (b = 0; b < WAIT_BUCKETS; b++) {
+            if (fscanf(f, "%llu", &recs[n].buckets[b]) != 1) break;
+        }
+        if (b < WAIT_BUCKETS) break;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+// Bucket holding the pct-th percentile
+int wait_percentile(const unsigned long long *buckets, unsigned long long total, int pct) {
+    unsigned long long target = (total * pct + 99) / 100;
+    unsigned long long seen = 0;
+
+    for (int b = 0; b < WAIT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= target) return b;
+    }
+    return WAIT_BUCKETS - 1;
+}
+
+// Bucket b holds waits below 2^b units. The last one is open-ended, so
+// only its lower bound, 2^(b-1) units, can be printed
+void print_wait_bound(int b) {
+    if (b == WAIT_BUCKETS - 1)
+        printf(">= %.0f", (double)(1ULL << (b - 1)) * 1.024);
+    else
+        printf("%.0f", (double)(1ULL << b) * 1.024);
+}
+
+// Waits over the monitoring window only: end snapshot minus start snapshot
+void print_wait_latency(void) {
+    WaitRecord *end = malloc(MAX_USERS * sizeof(WaitRecord));
+    int num_end;
+
+    if (!end) {
+        perror("malloc");
+        return;
+    }
+    num_end = read_wait_hist(end, MAX_USERS);
+    if (num_end < 0 || num_wait_start < 0) {
+        fprintf(stderr, "%s not available, needs the Task2B kernel\n", WAIT_PROC);
+        free(end);
+        return;
+    }
+
+    printf("\nUser\tWaits\tp50 Wait (microseconds)\tp99 Wait (microseconds)\n");
+    unsigned long long all_waits = 0;
+    for (int i = 0; i < num_end; i++) {
+        unsigned long long total = 0;
+
+        for (int j = 0; j < num_wait_start; j++) {
+            if (wait_start[j].uid != end[i].uid) continue;
+            for (int b = 0; b < WAIT_BUCKETS; b++)
+                end[i].buckets[b] -= wait_start[j].buckets[b];
+            break;
+        }
+        for (int b = 0; b < WAIT_BUCKETS; b++)
+            total += end[i].buckets[b];
+        if (!total) continue;
+        all_waits += total;
+
+        printf("%u\t%llu\t", end[i].uid, total);
+        print_wait_bound(wait_percentile(end[i].buckets, total, 50));
+        printf("\t");
+        print_wait_bound(wait_percentile(end[i].buckets, total, 99));
+        printf("\n");
+    }
+    // Users whose counts did not move over the window don't count either
+    if (all_waits == 0)
+        fprintf(stderr, "No waits recorded, is kernel.sched_schedstats on?\n");
+    free(end);
+}
@@ -4676,12 +4676,32 @@ static int __init sched_core_sysctl_init(void)
 late_initcall(sched_core_sysctl_init);
 #endif /* CONFIG_SYSCTL */
 
+/* --- BEGIN TASK 2B: PER-USER GROUP SCHEDULING --- */
+/*
+ * Defined in Task 2B's fair.c, next to the rest of the per-user code. This
+ * core.c also builds with Task 1's fair.c, which has no per-user groups.
+ */
+void __weak user_group_fork(struct task_struct *p) { }
+
+struct task_group * __weak user_group_task_group(struct task_struct *p,
+                                                 struct task_group *tg)
+{
+	return tg;
+}
+/* --- END TASK 2B MODIFICATION --- */
+
 /*
  * fork()/clone()-time setup:
  */
 int sched_fork(unsigned long clone_flags, struct task_struct *p)
 {
 	__sched_fork(clone_flags, p);
+
+	/* --- BEGIN TASK 2B: PER-USER GROUP SCHEDULING --- */
+	// Creating the group may sleep; sched_cgroup_fork() only looks it up.
+	user_group_fork(p);
+	/* --- END TASK 2B MODIFICATION --- */
+
 	/*
 	 * We mark the process as NEW here. This guarantees that
 	 * nobody will actually run it, and a signal or other external
@@ -4766,6 +4786,9 @@ int sched_cgroup_fork(struct task_struct *p, struct kernel_clone_args *kargs)
 		struct task_group *tg;
 		tg = container_of(kargs->cset->subsys[cpu_cgrp_id],
 				  struct task_group, css);
+		/* --- BEGIN TASK 2B: PER-USER GROUP SCHEDULING --- */
+		tg = user_group_task_group(p, tg);
+		/* --- END TASK 2B MODIFICATION --- */
 		tg = autogroup_task_group(p, tg);
 		p->sched_task_group = tg;
 	}
@@ -5961,6 +5984,22 @@ static void prev_balance(struct rq *rq, struct task_struct *prev,
 	}
 }
 
+/* --- BEGIN TASK 1: ENTANGLEMENT FOR ALL CLASSES --- */
+/*
+ * Flipped by Task 1's fair.c while an entanglement group is installed, and
+ * the hooks below are defined there. With Task 2B's fair.c the key stays
+ * off and the defaults are never called.
+ */
+DEFINE_STATIC_KEY_FALSE(sched_entangle_key);
+
+bool __weak entangle_pick_allowed(struct rq *rq, struct task_struct *p)
+{
+	return true;
+}
+
+void __weak entangle_class_picked(struct rq *rq, struct task_struct *p) { }
+/* --- END TASK 1 MODIFICATION --- */
+
 /*
  * Pick up the highest-prio task:
  */
@@ -6008,7 +6047,24 @@ restart:
 		} else {
 			p = class->pick_task(rq);
 			if (p) {
+				/* --- BEGIN TASK 1: ENTANGLEMENT FOR ALL CLASSES --- */
+				/*
+				 * pick_next_task_fair() does its own check, every
+				 * other class (and fair_server picking through the
+				 * deadline class) is checked here. A refused task
+				 * leaves the pick to the classes below it.
+				 */
+				if (static_branch_unlikely(&sched_entangle_key) &&
+				    !entangle_pick_allowed(rq, p)) {
+					rq->dl_server = NULL;
+					continue;
+				}
+				/* --- END TASK 1 MODIFICATION --- */
 				put_prev_set_next_task(rq, prev, p);
+				/* --- BEGIN TASK 1: ENTANGLEMENT FOR ALL CLASSES --- */
+				if (static_branch_unlikely(&sched_entangle_key))
+					entangle_class_picked(rq, p);
+				/* --- END TASK 1 MODIFICATION --- */
 				return p;
 			}
 		}
@@ -8946,6 +9002,9 @@ static void sched_change_group(struct task_struct *tsk)
 	 */
 	tg = container_of(task_css_check(tsk, cpu_cgrp_id, true),
 			  struct task_group, css);
+	/* --- BEGIN TASK 2B: PER-USER GROUP SCHEDULING --- */
+	tg = user_group_task_group(tsk, tg);
+	/* --- END TASK 2B MODIFICATION --- */
 	tg = autogroup_task_group(tsk, tg);
 	tsk->sched_task_group = tg;
 
@@ -9311,8 +9370,11 @@ static const u64 max_cfs_runtime = MAX_BW * NSEC_PER_USEC;
 
 static int __cfs_schedulable(struct task_group *tg, u64 period, u64 runtime);
 
-static int tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota,
-				u64 burst)
+/* --- BEGIN TASK 2B: PER-USER CPU QUOTA --- */
+/* Not static: fair.c sets the per-user quotas on the users' groups with it */
+int tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota,
+			 u64 burst)
+/* --- END TASK 2B MODIFICATION --- */
 {
 	int i, ret = 0, runtime_enabled, runtime_was_enabled;
 	struct cfs_bandwidth *cfs_b = &tg->cfs_bandwidth;
@@ -57,12 +57,20 @@
 
 #include <linux/uidgid.h>
 #include <linux/atomic.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
 
 #define MAX_TRACKED_USERS 256 // Support up to 256 unique users
 
 struct user_accounting {
     kuid_t uid;
     atomic64_t total_exec_time; 
+    unsigned long util_avg; // As of the last user_fair_refresh() that read it
+    u64 fair_exec; // total_exec_time at that refresh
+    unsigned int fair_scale; // See user_fair_penalty(), SCHED_FIXEDPOINT_SCALE is none
+    bool has_quota; // CPU quota set on tg, see user_bw_set()
+    struct task_group *tg; // Per-user group, see user_group_fork()
     bool is_active;
 };
 
@@ -70,53 +78,406 @@ struct user_accounting {
 static struct user_accounting user_stats[MAX_TRACKED_USERS];
 static DEFINE_SPINLOCK(user_stats_lock);
 
-/* * Helper to safely add execution time to a user's total.
- * We only care about users with UID >= 1000.
+/*
+ * The accounting hooks in update_curr(), the tick and the pick are patched
+ * in only once something uses them: a reader opens /proc/sched_user_stats*,
+ * or sched_user_fair is turned on. They stay on from then on, so the
+ * totals never have holes.
  */
-static void account_user_exec_time(struct task_struct *p, u64 delta_exec)
+static DEFINE_STATIC_KEY_FALSE(sched_user_acct);
+
+static void user_acct_enable(void)
 {
-    kuid_t task_uid = task_uid(p);
-    int i, empty_slot = -1;
+    if (!static_key_enabled(&sched_user_acct))
+        static_branch_enable(&sched_user_acct);
+}
 
-    // The assignment requires us to only consider users with UID >= 1000 
-    if (__kuid_val(task_uid) < 1000) {
-        return; 
-    }
+/*
+ * Phase 3: user-level fairness.
+ *
+ * When sysctl_sched_user_fair is set, the vruntime of a task is advanced
+ * faster by a per-user scale driven by the user's decayed CPU share, so
+ * each busy user ends up with an equal share and one UID with 500 threads
+ * can no longer starve a UID with 5. The scales are updated from the tick
+ * every sysctl_sched_user_fair_period_ms, see user_fair_refresh().
+ */
+static unsigned int sysctl_sched_user_fair = 0;
+static unsigned int sysctl_sched_user_fair_period_ms = 32;
+static unsigned int sysctl_sched_user_fair_max_scale = 8;
+/* Keeps the fixed point scales and their products in range */
+static unsigned int sysctl_sched_user_fair_max_scale_max = 1024;
+
+#ifdef CONFIG_SCHED_AUTOGROUP
+/* Per-user group scheduling, see user_group_fork() */
+static unsigned int sysctl_sched_user_group = 0;
+/* Users with a CPU quota, whose tasks use their group regardless */
+static atomic_t nr_user_bandwidth = ATOMIC_INIT(0);
+#endif
+
+static u64 user_util_next_refresh;
+static unsigned int user_fair_cursor;
+
+static void user_util_update(struct user_accounting *ua, int cpu, u64 now, u64 delta_exec);
+
+/*
+ * Lockless lookup of @uid in @table, user_stats outside the KUnit tests.
+ * Pairs with the smp_wmb() in __user_stats_get() so a slot seen active has
+ * its uid set.
+ */
+static struct user_accounting *__user_stats_find(struct user_accounting *table, kuid_t uid)
+{
+    int i;
 
-    // 1. Lockless search: Try to find the user in our array
     for (i = 0; i < MAX_TRACKED_USERS; i++) {
-        if (user_stats[i].is_active && uid_eq(user_stats[i].uid, task_uid)) {
-            // Found them! Atomically add the elapsed time (in nanoseconds)
-            atomic64_add(delta_exec, &user_stats[i].total_exec_time);
-            return;
+        if (READ_ONCE(table[i].is_active)) {
+            smp_rmb();
+            if (uid_eq(table[i].uid, uid))
+                return &table[i];
         }
     }
+    return NULL;
+}
+
+static struct user_accounting *user_stats_find(kuid_t uid)
+{
+    return __user_stats_find(user_stats, uid);
+}
+
+/*
+ * Per-CPU batching of the accounting. update_curr() runs several times per
+ * context switch, so it only adds to the slot of the CPU's current uid; the
+ * slot is flushed into user_stats when a task of another uid is accounted,
+ * when the CPU goes idle and from task_tick_fair(). Protected by the rq lock
+ * of its CPU (update_curr() may run for a remote rq).
+ */
+struct user_pending {
+    kuid_t uid;
+    struct user_accounting *ua; // NULL if uid is not tracked
+    u64 delta_exec;
+};
+
+static DEFINE_PER_CPU(struct user_pending, user_pending);
+
+/*
+ * Where each user's time went: exact runtime per CPU (per-node figures are
+ * summed from it when read) plus tick samples of user vs. kernel mode, used
+ * to split the runtime like cputime_adjust() does for a task. One 16-byte
+ * entry per user per CPU, so a flush touches a single local cacheline and
+ * only the owning CPU ever writes it (under its rq lock).
+ */
+struct user_cpu_stats {
+    u64 exec_time;
+    u32 user_ticks;
+    u32 system_ticks;
+};
+
+static DEFINE_PER_CPU(struct user_cpu_stats [MAX_TRACKED_USERS], user_cpu_stats);
+
+static inline struct user_cpu_stats *user_cpu_stats_of(struct user_accounting *ua, int cpu)
+{
+    return &per_cpu(user_cpu_stats, cpu)[ua - user_stats];
+}
+
+/*
+ * Runqueue wait of each user's tasks as log2 histograms: bucket b counts
+ * waits in [2^(b-1), 2^b) units of 1024 ns, bucket 0 the ones below 1024 ns
+ * and the last bucket everything longer. Fed from
+ * update_stats_wait_end_fair(), so only while schedstats are on, reusing
+ * their wait_start. Laid out and written like user_cpu_stats, but
+ * allocated at boot as it is too big for the static per-CPU area.
+ */
+#define USER_WAIT_BUCKETS 24
+
+struct user_wait_hist {
+    u32 buckets[USER_WAIT_BUCKETS];
+};
+
+static struct user_wait_hist __percpu *user_wait_hist;
+
+static inline struct user_wait_hist *user_wait_hist_of(struct user_accounting *ua, int cpu)
+{
+    return per_cpu_ptr(user_wait_hist, cpu) + (ua - user_stats);
+}
+
+/*
+ * Find the entry for @uid in @table, adding it under @lock if needed.
+ * Returns NULL if the table is full.
+ */
+static struct user_accounting *__user_stats_get(struct user_accounting *table, spinlock_t *lock,
+                                                kuid_t uid)
+{
+    struct user_accounting *ua;
+    int i, empty_slot = -1;
+
+    // 1. Lockless search: Try to find the user in our array
+    ua = __user_stats_find(table, uid);
+    if (ua)
+        return ua;
 
     // 2. User not found. We need to lock and add them.
-    spin_lock(&user_stats_lock);
+    spin_lock(lock);
     
     // Double-check in case another CPU just added them while we were waiting for the lock
     for (i = 0; i < MAX_TRACKED_USERS; i++) {
-        if (user_stats[i].is_active && uid_eq(user_stats[i].uid, task_uid)) {
-            atomic64_add(delta_exec, &user_stats[i].total_exec_time);
-            spin_unlock(&user_stats_lock);
-            return;
+        if (table[i].is_active && uid_eq(table[i].uid, uid)) {
+            spin_unlock(lock);
+            return &table[i];
         }
-        if (!user_stats[i].is_active && empty_slot == -1) {
+        if (!table[i].is_active && empty_slot == -1) {
             empty_slot = i; // Remember the first empty slot
         }
     }
 
     // Add the new user to the empty slot
+    ua = NULL;
     if (empty_slot != -1) {
-        user_stats[empty_slot].uid = task_uid;
-        atomic64_set(&user_stats[empty_slot].total_exec_time, delta_exec);
+        ua = &table[empty_slot];
+        ua->uid = uid;
+        atomic64_set(&ua->total_exec_time, 0);
+        // Per-CPU stats and wait histograms start zeroed and slots are never freed
+        ua->util_avg = 0;
+        ua->fair_exec = 0;
+        ua->fair_scale = SCHED_FIXEDPOINT_SCALE;
+        ua->has_quota = false;
+        ua->tg = NULL;
         // Ensure memory writes are ordered before marking active
         smp_wmb(); 
-        user_stats[empty_slot].is_active = true;
+        ua->is_active = true;
     }
     
-    spin_unlock(&user_stats_lock);
+    spin_unlock(lock);
+    return ua;
+}
+
+static struct user_accounting *user_stats_get(kuid_t uid)
+{
+    return __user_stats_get(user_stats, &user_stats_lock, uid);
+}
+
+/* Push the time batched on @rq's CPU into user_stats. */
+static void user_stats_flush(struct rq *rq)
+{
+    struct user_pending *pending = per_cpu_ptr(&user_pending, cpu_of(rq));
+
+    lockdep_assert_rq_held(rq);
+
+    if (!pending->delta_exec)
+        return;
+
+    user_cpu_stats_of(pending->ua, cpu_of(rq))->exec_time += pending->delta_exec;
+    atomic64_add(pending->delta_exec, &pending->ua->total_exec_time);
+    user_util_update(pending->ua, cpu_of(rq), rq_clock(rq), pending->delta_exec);
+    pending->delta_exec = 0;
+}
+
+/*
+ * Sample whether the tick interrupted the current task in user or kernel
+ * mode. Only possible for the local tick; remote (nohz_full offload) ticks
+ * are not sampled.
+ */
+static void user_stats_tick(struct rq *rq, struct task_struct *curr)
+{
+    struct user_pending *pending = per_cpu_ptr(&user_pending, cpu_of(rq));
+    struct user_cpu_stats *stats;
+    struct pt_regs *regs;
+
+    if (!pending->ua || !uid_eq(pending->uid, task_uid(curr)))
+        return;
+
+    if (!in_hardirq() || cpu_of(rq) != smp_processor_id())
+        return;
+
+    regs = get_irq_regs();
+    if (!regs)
+        return;
+
+    stats = user_cpu_stats_of(pending->ua, cpu_of(rq));
+    if (user_mode(regs))
+        stats->user_ticks++;
+    else
+        stats->system_ticks++;
+}
+
+/*
+ * Batch @delta_exec in @pending if it batches for @uid; dropped if @uid is
+ * not tracked. Returns false if it batches for another uid, which then has
+ * to be flushed first.
+ */
+static inline bool user_pending_add(struct user_pending *pending, kuid_t uid, u64 delta_exec)
+{
+    if (!uid_eq(pending->uid, uid))
+        return false;
+
+    if (pending->ua)
+        pending->delta_exec += delta_exec;
+    return true;
+}
+
+/* * Helper to add execution time to a user's total.
+ * We only care about users with UID >= 1000.
+ */
+static void account_user_exec_time(struct rq *rq, struct task_struct *p, u64 delta_exec)
+{
+    struct user_pending *pending = per_cpu_ptr(&user_pending, cpu_of(rq));
+    kuid_t task_uid = task_uid(p);
+
+    // Fast path: same uid as last time on this CPU, just batch the delta
+    if (likely(user_pending_add(pending, task_uid, delta_exec)))
+        return;
+
+    user_stats_flush(rq);
+    pending->uid = task_uid;
+    pending->ua = NULL;
+
+    // The assignment requires us to only consider users with UID >= 1000 
+    if (__kuid_val(task_uid) < 1000)
+        return; 
+
+    pending->ua = user_stats_get(task_uid);
+    if (pending->ua)
+        pending->delta_exec = delta_exec;
+}
+
+/*
+ * Count a runqueue wait of @delta ns by @p in its user's histogram on
+ * @rq's CPU. Users not tracked yet are skipped; they are added once they
+ * have run.
+ */
+static void user_wait_record(struct rq *rq, struct task_struct *p, u64 delta)
+{
+    struct user_pending *pending = per_cpu_ptr(&user_pending, cpu_of(rq));
+    struct user_accounting *ua;
+    unsigned int bucket;
+
+    if (!user_wait_hist || __kuid_val(task_uid(p)) < 1000)
+        return;
+
+    if (uid_eq(pending->uid, task_uid(p)))
+        ua = pending->ua;
+    else
+        ua = user_stats_find(task_uid(p));
+    if (!ua)
+        return;
+
+    bucket = min_t(unsigned int, fls64(delta >> 10), USER_WAIT_BUCKETS - 1);
+    user_wait_hist_of(ua, cpu_of(rq))->buckets[bucket]++;
+}
+
+/* Users re-read per refresh; each read is one load per possible CPU */
+#define USER_FAIR_REFRESH_BATCH 16
+/* Users below 1/64 of a CPU are not busy, and don't count towards the shares */
+#define USER_FAIR_MIN_UTIL (SCHED_CAPACITY_SCALE / 64)
+
+static unsigned long user_util_read(struct user_accounting *ua, u64 now);
+
+/*
+ * Move each busy user's scale towards the one that gives it an equal share.
+ * Called from the tick on every CPU; the cmpxchg on user_util_next_refresh
+ * elects one of them per period.
+ *
+ * Each user whose utilization is re-read gets its scale multiplied by its
+ * share of the busy users' utilization over the equal share and clamped
+ * to [1, sysctl_sched_user_fair_max_scale]. A user held back to its equal
+ * share keeps its scale, one below it loses some. The utilization decays
+ * like PELT (half-life of 32ms), so the scale settles within a few periods.
+ *
+ * Reading a user's utilization sums every CPU's part, so at most
+ * USER_FAIR_REFRESH_BATCH users are re-read per period, round robin.
+ * Users that have not run since their utilization decayed to zero are
+ * skipped without a read.
+ */
+static void user_fair_refresh(struct rq *rq)
+{
+    u64 now = rq_clock(rq);
+    u64 next = READ_ONCE(user_util_next_refresh);
+    u64 period = (u64)READ_ONCE(sysctl_sched_user_fair_period_ms) * NSEC_PER_MSEC;
+    u64 max_scale = (u64)READ_ONCE(sysctl_sched_user_fair_max_scale) << SCHED_FIXEDPOINT_SHIFT;
+    DECLARE_BITMAP(fresh, MAX_TRACKED_USERS);
+    unsigned long total = 0;
+    unsigned int nr = 0, batch = 0;
+    int i, n;
+
+    if (!READ_ONCE(sysctl_sched_user_fair) || (s64)(now - next) < 0)
+        return;
+
+    if (cmpxchg64(&user_util_next_refresh, next, now + period) != next)
+        return;
+
+    bitmap_zero(fresh, MAX_TRACKED_USERS);
+    for (n = 0; n < MAX_TRACKED_USERS && batch < USER_FAIR_REFRESH_BATCH; n++) {
+        struct user_accounting *ua = &user_stats[(user_fair_cursor + n) % MAX_TRACKED_USERS];
+        u64 exec;
+
+        if (!READ_ONCE(ua->is_active))
+            continue;
+
+        exec = atomic64_read(&ua->total_exec_time);
+        if (!ua->util_avg && exec == ua->fair_exec)
+            continue;
+
+        WRITE_ONCE(ua->util_avg, user_util_read(ua, now));
+        ua->fair_exec = exec;
+        __set_bit(ua - user_stats, fresh);
+        batch++;
+    }
+    user_fair_cursor = (user_fair_cursor + n) % MAX_TRACKED_USERS;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        unsigned long util = READ_ONCE(user_stats[i].util_avg);
+
+        if (READ_ONCE(user_stats[i].is_active) && util >= USER_FAIR_MIN_UTIL) {
+            total += util;
+            nr++;
+        }
+    }
+
+    for_each_set_bit(i, fresh, MAX_TRACKED_USERS) {
+        struct user_accounting *ua = &user_stats[i];
+        u64 scale = SCHED_FIXEDPOINT_SCALE;
+
+        if (nr >= 2 && ua->util_avg >= USER_FAIR_MIN_UTIL) {
+            // util * nr / total is the share over the equal one
+            scale = div64_u64((u64)ua->fair_scale * ua->util_avg * nr, total);
+            scale = clamp_t(u64, scale, SCHED_FIXEDPOINT_SCALE, max_scale);
+        }
+        WRITE_ONCE(ua->fair_scale, scale);
+    }
+}
+
+/*
+ * Scale @delta_fair for @p by its user's fair_scale. EEVDF shares a CPU by
+ * weight, so a user with 100 times the threads of another gets 100 times
+ * the time; advancing its vruntime faster holds it back to its share, and
+ * max_scale bounds how far. Scales only move at refresh time, so a lowered
+ * max_scale is applied here as well.
+ */
+static u64 user_fair_penalty(struct rq *rq, struct task_struct *p, u64 delta_fair)
+{
+    struct user_pending *pending = per_cpu_ptr(&user_pending, cpu_of(rq));
+    struct user_accounting *ua;
+    u64 scale, max_scale;
+
+    if (!READ_ONCE(sysctl_sched_user_fair))
+        return delta_fair;
+
+    if (__kuid_val(task_uid(p)) < 1000)
+        return delta_fair;
+
+    if (uid_eq(pending->uid, task_uid(p)))
+        ua = pending->ua;
+    else
+        ua = user_stats_find(task_uid(p));
+    if (!ua)
+        return delta_fair;
+
+    scale = READ_ONCE(ua->fair_scale);
+    if (scale <= SCHED_FIXEDPOINT_SCALE)
+        return delta_fair;
+
+    max_scale = (u64)READ_ONCE(sysctl_sched_user_fair_max_scale) << SCHED_FIXEDPOINT_SHIFT;
+    scale = min(scale, max_scale);
+
+    return mul_u64_u32_shr(delta_fair, scale, SCHED_FIXEDPOINT_SHIFT);
 }
 
 /*
@@ -194,6 +555,17 @@ static unsigned int sysctl_numa_balancing_promote_rate_limit = 65536;
 #endif
 
 #ifdef CONFIG_SYSCTL
+/* The fairness needs the per-user table, so switch the accounting on */
+static int sched_user_fair_handler(const struct ctl_table *table, int write,
+                                   void *buffer, size_t *lenp, loff_t *ppos)
+{
+    int ret = proc_douintvec_minmax(table, write, buffer, lenp, ppos);
+
+    if (!ret && write && READ_ONCE(sysctl_sched_user_fair))
+        user_acct_enable();
+    return ret;
+}
+
 static struct ctl_table sched_fair_sysctls[] = {
 #ifdef CONFIG_CFS_BANDWIDTH
 	{
@@ -204,6 +576,43 @@ static struct ctl_table sched_fair_sysctls[] = {
 		.proc_handler   = proc_dointvec_minmax,
 		.extra1         = SYSCTL_ONE,
 	},
+#endif
+	{
+		.procname	= "sched_user_fair",
+		.data		= &sysctl_sched_user_fair,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= sched_user_fair_handler,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+	{
+		.procname	= "sched_user_fair_period_ms",
+		.data		= &sysctl_sched_user_fair_period_ms,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec_minmax,
+		.extra1		= SYSCTL_ONE,
+	},
+	{
+		.procname	= "sched_user_fair_max_scale",
+		.data		= &sysctl_sched_user_fair_max_scale,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec_minmax,
+		.extra1		= SYSCTL_ONE,
+		.extra2		= &sysctl_sched_user_fair_max_scale_max,
+	},
+#ifdef CONFIG_SCHED_AUTOGROUP
+	{
+		.procname	= "sched_user_group",
+		.data		= &sysctl_sched_user_group,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
 #endif
 #ifdef CONFIG_NUMA_BALANCING
 	{
@@ -1083,6 +1492,384 @@ static bool update_deadline(struct cfs_rq *cfs_rq, struct sched_entity *se)
 }
 
 #include "pelt.h"
+
+/*
+ * Per-user utilization, using the same geometric series as the per-entity
+ * load tracking behind update_load_avg(): y^LOAD_AVG_PERIOD = 0.5 and the
+ * sum saturates at LOAD_AVG_MAX per fully busy CPU.
+ */
+#ifdef CONFIG_SMP
+/* Mirrors decay_load() in pelt.c: val * y^n using runnable_avg_yN_inv[]. */
+static u64 user_util_decay(u64 val, u64 n)
+{
+    unsigned int local_n;
+
+    if (unlikely(n > LOAD_AVG_PERIOD * 63))
+        return 0;
+
+    local_n = n;
+    if (unlikely(local_n >= LOAD_AVG_PERIOD)) {
+        val >>= local_n / LOAD_AVG_PERIOD;
+        local_n %= LOAD_AVG_PERIOD;
+    }
+
+    return mul_u64_u32_shr(val, runnable_avg_yN_inv[local_n], 32);
+}
+
+/*
+ * Each CPU keeps its own share of every user's util_sum, written only by
+ * that CPU under its rq lock from user_stats_flush(), so accounting never
+ * shares a cacheline or a lock with other CPUs. The decay is linear, so
+ * the user's utilization is the sum of the per-CPU ones; readers add them
+ * up in user_util_read(). A CPU is busy at most LOAD_AVG_MAX of the time,
+ * which bounds util_sum to 32 bits.
+ */
+struct user_cpu_util {
+    u64 last_update;
+    u32 util_sum;
+    u32 period_contrib;
+};
+
+static DEFINE_PER_CPU(struct user_cpu_util [MAX_TRACKED_USERS], user_cpu_util);
+
+/*
+ * Fold @delta_exec ns of running time on @cpu into @ua's util_sum there
+ * at @now.
+ *
+ * Unlike a sched_entity a user runs on several CPUs at once and is idle in
+ * between, so instead of accumulating whole running segments we decay the
+ * sum over the wall time elapsed since the last update and then add the
+ * running time as a contribution of the current period. The pending time
+ * is flushed at least once per tick, so the error is bounded by a tick.
+ */
+static void user_util_update(struct user_accounting *ua, int cpu, u64 now, u64 delta_exec)
+{
+    struct user_cpu_util *cu = &per_cpu(user_cpu_util, cpu)[ua - user_stats];
+    u64 delta, periods, sum;
+
+    delta = now - cu->last_update;
+    if ((s64)delta < 0)
+        delta = 0;
+
+    sum = cu->util_sum;
+
+    /* Same 1us (1024ns) granularity as ___update_load_sum() */
+    delta >>= 10;
+    if (delta) {
+        WRITE_ONCE(cu->last_update, cu->last_update + (delta << 10));
+        delta += cu->period_contrib;
+        periods = delta / 1024;
+        if (periods)
+            sum = user_util_decay(sum, periods);
+        WRITE_ONCE(cu->period_contrib, delta % 1024);
+    }
+
+    sum += (delta_exec >> 10) << SCHED_CAPACITY_SHIFT;
+    WRITE_ONCE(cu->util_sum, min_t(u64, sum, (u64)LOAD_AVG_MAX << SCHED_CAPACITY_SHIFT));
+}
+
+/* Utilization of @ua at @now with no further running time, over all CPUs. */
+static unsigned long user_util_read(struct user_accounting *ua, u64 now)
+{
+    unsigned long util = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct user_cpu_util *cu = &per_cpu(user_cpu_util, cpu)[ua - user_stats];
+        u64 delta = now - READ_ONCE(cu->last_update);
+        u32 contrib = READ_ONCE(cu->period_contrib);
+        u64 sum = READ_ONCE(cu->util_sum);
+
+        if (!sum)
+            continue;
+
+        if ((s64)delta > 0)
+            sum = user_util_decay(sum, ((delta >> 10) + contrib) / 1024);
+
+        /* Same divider as get_pelt_divider() */
+        util += div_u64(sum, PELT_MIN_DIVIDER + contrib);
+    }
+
+    return util;
+}
+#else /* !CONFIG_SMP */
+static void user_util_update(struct user_accounting *ua, int cpu, u64 now, u64 delta_exec) { }
+static unsigned long user_util_read(struct user_accounting *ua, u64 now) { return 0; }
+#endif /* CONFIG_SMP */
+
+#ifdef CONFIG_SCHED_AUTOGROUP
+/*
+ * Per-user group scheduling, the old FAIR_USER_SCHED without cgroups: with
+ * sysctl_sched_user_group set, the tasks of a user with UID >= 1000 that
+ * would run in the root group run in a task group of their user instead.
+ * Every group keeps the default shares, so calc_group_shares() and
+ * update_cfs_group() give each busy user the same weight however many
+ * threads it has, and the threads split their user's share.
+ *
+ * The groups have no cgroup, so they are built as autogroups: the rest of
+ * the scheduler then knows not to look for one (task_group_path() shows
+ * them as /autogroup-<uid>), RT tasks run in the root group and
+ * sched_setscheduler() lets tasks in them become RT. A task in a cpu cgroup
+ * stays there, and a user's group takes precedence over its session's
+ * autogroup. A group is created by the first fork of its user once the
+ * sysctl is on, or when the user is given a quota, and lives as long as the
+ * user's user_stats slot, i.e. for good. Only forks and group moves look at the sysctl, so existing tasks
+ * keep their group when it is flipped.
+ */
+static DEFINE_MUTEX(user_group_mutex);
+
+/* autogroup_create() with the id set to the uid and no signal_struct */
+static struct task_group *user_group_create(kuid_t uid)
+{
+    struct autogroup *ag;
+    struct task_group *tg;
+
+    ag = kzalloc(sizeof(*ag), GFP_KERNEL);
+    if (!ag)
+        return ERR_PTR(-ENOMEM);
+
+    tg = sched_create_group(&root_task_group);
+    if (IS_ERR(tg)) {
+        kfree(ag);
+        return tg;
+    }
+
+    kref_init(&ag->kref);
+    init_rwsem(&ag->lock);
+    ag->id = __kuid_val(uid);
+    ag->tg = tg;
+#ifdef CONFIG_RT_GROUP_SCHED
+    // As for autogroups: no RT bandwidth to manage, RT tasks use the root's
+    free_rt_sched_group(tg);
+    tg->rt_se = root_task_group.rt_se;
+    tg->rt_rq = root_task_group.rt_rq;
+#endif
+    tg->autogroup = ag;
+
+    sched_online_group(tg, &root_task_group);
+    return tg;
+}
+
+/* @ua's group, created if it has none yet; NULL if that fails. May sleep. */
+static struct task_group *user_group_get(struct user_accounting *ua)
+{
+    struct task_group *tg = smp_load_acquire(&ua->tg);
+
+    if (tg)
+        return tg;
+
+    mutex_lock(&user_group_mutex);
+    tg = ua->tg;
+    if (!tg) {
+        tg = user_group_create(ua->uid);
+        if (IS_ERR(tg))
+            tg = NULL;
+        else
+            smp_store_release(&ua->tg, tg);
+    }
+    mutex_unlock(&user_group_mutex);
+    return tg;
+}
+
+/* Called from sched_fork(), where we may still sleep. */
+void user_group_fork(struct task_struct *p)
+{
+    struct user_accounting *ua;
+    unsigned long flags;
+
+    if (!READ_ONCE(sysctl_sched_user_group) || __kuid_val(task_uid(p)) < 1000)
+        return;
+
+    // user_stats_lock is taken from update_curr() with interrupts off
+    local_irq_save(flags);
+    ua = user_stats_get(task_uid(p));
+    local_irq_restore(flags);
+    if (ua)
+        user_group_get(ua);
+}
+
+/*
+ * The group @p runs in when its cgroup says @tg. Same rules as
+ * task_wants_autogroup(); a user without a group yet (table full or
+ * allocation failure) stays in @tg. A user with a quota (see user_bw_set())
+ * uses its group even with sched_user_group off.
+ */
+struct task_group *user_group_task_group(struct task_struct *p, struct task_group *tg)
+{
+    bool grouped = READ_ONCE(sysctl_sched_user_group);
+    struct user_accounting *ua;
+    struct task_group *utg;
+
+    if (tg != &root_task_group || (!grouped && !atomic_read(&nr_user_bandwidth)))
+        return tg;
+    if (p->sched_class != &fair_sched_class || (p->flags & PF_EXITING))
+        return tg;
+    if (__kuid_val(task_uid(p)) < 1000)
+        return tg;
+
+    ua = user_stats_find(task_uid(p));
+    if (!ua || (!grouped && !READ_ONCE(ua->has_quota)))
+        return tg;
+    utg = smp_load_acquire(&ua->tg);
+    return utg ? utg : tg;
+}
+#else /* CONFIG_SCHED_AUTOGROUP */
+void user_group_fork(struct task_struct *p) { }
+struct task_group *user_group_task_group(struct task_struct *p, struct task_group *tg) { return tg; }
+#endif /* CONFIG_SCHED_AUTOGROUP */
+
+#ifdef CONFIG_PROC_FS
+/*
+ * /proc/sched_user_stats: one line per tracked user,
+ * "<uid> <total_exec_time ns> <util_avg> <user ns> <system ns> <node0 ns> ...",
+ * with one column per possible NUMA node. Node figures cover the CPUs
+ * currently mapped to the node.
+ */
+static int user_stats_show(struct seq_file *m, void *v)
+{
+    u64 now = local_clock();
+    int i, cpu, node;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        struct user_accounting *ua = &user_stats[i];
+        u64 exec = 0, utime, stime;
+        u64 uticks = 0, sticks = 0;
+
+        if (!READ_ONCE(ua->is_active))
+            continue;
+        smp_rmb();
+
+        for_each_possible_cpu(cpu) {
+            struct user_cpu_stats *stats = user_cpu_stats_of(ua, cpu);
+
+            exec += READ_ONCE(stats->exec_time);
+            uticks += READ_ONCE(stats->user_ticks);
+            sticks += READ_ONCE(stats->system_ticks);
+        }
+
+        /* Same split as cputime_adjust(): no samples means user time */
+        if (!sticks) {
+            utime = exec;
+            stime = 0;
+        } else if (!uticks) {
+            utime = 0;
+            stime = exec;
+        } else {
+            stime = mul_u64_u64_div_u64(exec, sticks, uticks + sticks);
+            utime = exec - stime;
+        }
+
+        seq_printf(m, "%u %llu %lu %llu %llu", __kuid_val(ua->uid),
+                   (unsigned long long)atomic64_read(&ua->total_exec_time),
+                   user_util_read(ua, now),
+                   (unsigned long long)utime, (unsigned long long)stime);
+        for_each_node(node) {
+            u64 node_exec = 0;
+
+            for_each_cpu(cpu, cpumask_of_node(node))
+                node_exec += READ_ONCE(user_cpu_stats_of(ua, cpu)->exec_time);
+            seq_printf(m, " %llu", (unsigned long long)node_exec);
+        }
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+/*
+ * /proc/sched_user_stats_cpu: "<uid> <cpu> <exec ns> <user ticks> <system ticks>"
+ * for every CPU a tracked user has run on.
+ */
+static int user_stats_cpu_show(struct seq_file *m, void *v)
+{
+    int i, cpu;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        struct user_accounting *ua = &user_stats[i];
+
+        if (!READ_ONCE(ua->is_active))
+            continue;
+        smp_rmb();
+
+        for_each_possible_cpu(cpu) {
+            struct user_cpu_stats *stats = user_cpu_stats_of(ua, cpu);
+            u64 exec = READ_ONCE(stats->exec_time);
+
+            if (!exec)
+                continue;
+
+            seq_printf(m, "%u %d %llu %u %u\n", __kuid_val(ua->uid), cpu,
+                       (unsigned long long)exec,
+                       READ_ONCE(stats->user_ticks),
+                       READ_ONCE(stats->system_ticks));
+        }
+    }
+    return 0;
+}
+
+/*
+ * /proc/sched_user_wait: "<uid> <bucket 0> ... <bucket 23>" per tracked
+ * user, the runqueue wait histograms summed over all CPUs (see struct
+ * user_wait_hist). Empty unless schedstats are enabled.
+ */
+static int user_wait_show(struct seq_file *m, void *v)
+{
+    int i, b, cpu;
+
+    if (!user_wait_hist)
+        return 0;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        struct user_accounting *ua = &user_stats[i];
+        u64 buckets[USER_WAIT_BUCKETS] = { };
+
+        if (!READ_ONCE(ua->is_active))
+            continue;
+        smp_rmb();
+
+        for_each_possible_cpu(cpu) {
+            struct user_wait_hist *hist = user_wait_hist_of(ua, cpu);
+
+            for (b = 0; b < USER_WAIT_BUCKETS; b++)
+                buckets[b] += READ_ONCE(hist->buckets[b]);
+        }
+
+        seq_printf(m, "%u", __kuid_val(ua->uid));
+        for (b = 0; b < USER_WAIT_BUCKETS; b++)
+            seq_printf(m, " %llu", (unsigned long long)buckets[b]);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+/* The first reader switches the accounting on */
+static int user_stats_open(struct inode *inode, struct file *file)
+{
+    user_acct_enable();
+    return single_open(file, pde_data(inode), NULL);
+}
+
+static const struct proc_ops user_stats_proc_ops = {
+    .proc_open      = user_stats_open,
+    .proc_read      = seq_read,
+    .proc_lseek     = seq_lseek,
+    .proc_release   = single_release,
+};
+
+static int __init user_stats_proc_init(void)
+{
+    user_wait_hist = __alloc_percpu(sizeof(struct user_wait_hist) * MAX_TRACKED_USERS,
+                                    __alignof__(struct user_wait_hist));
+    proc_create_data("sched_user_stats", 0444, NULL, &user_stats_proc_ops,
+                     user_stats_show);
+    proc_create_data("sched_user_stats_cpu", 0444, NULL, &user_stats_proc_ops,
+                     user_stats_cpu_show);
+    if (user_wait_hist)
+        proc_create_data("sched_user_wait", 0444, NULL, &user_stats_proc_ops,
+                         user_wait_show);
+    return 0;
+}
+late_initcall(user_stats_proc_init);
+#endif /* CONFIG_PROC_FS */
 #ifdef CONFIG_SMP
 
 static int select_idle_sibling(struct task_struct *p, int prev_cpu, int cpu);
@@ -1270,6 +2057,7 @@ static void update_curr(struct cfs_rq *cfs_rq)
     struct sched_entity *curr = cfs_rq->curr;
     struct rq *rq = rq_of(cfs_rq);
     s64 delta_exec;
+    u64 delta_fair;
     bool resched;
 
     if (unlikely(!curr))
@@ -1279,10 +2067,13 @@ static void update_curr(struct cfs_rq *cfs_rq)
     if (unlikely(delta_exec <= 0))
         return;
 
-    /* * Note: In Phase 3, this is where we will apply the penalty to 
-     * curr->vruntime if the user is a CPU hog!
-     */
-    curr->vruntime += calc_delta_fair(delta_exec, curr);
+    /* --- BEGIN TASK 2B PHASE 3: USER CPU-HOG PENALTY --- */
+    // CPU-hog users age faster so their threads get picked less often.
+    delta_fair = calc_delta_fair(delta_exec, curr);
+    if (static_branch_unlikely(&sched_user_acct) && entity_is_task(curr))
+        delta_fair = user_fair_penalty(rq, task_of(curr), delta_fair);
+    curr->vruntime += delta_fair;
+    /* --- END TASK 2B PHASE 3 MODIFICATION --- */
     resched = update_deadline(cfs_rq, curr);
 
     if (entity_is_task(curr)) {
@@ -1291,9 +2082,10 @@ static void update_curr(struct cfs_rq *cfs_rq)
         update_curr_task(p, delta_exec);
 
         /* --- BEGIN TASK 2B: USER CPU ACCOUNTING --- */
-        // We pass the task and the time it just ran to our global tracker.
+        // We pass the task and the time it just ran to our per-CPU batch.
         // Inside this helper, it will check if UID >= 1000 and add the time.
-        account_user_exec_time(p, delta_exec);
+        if (static_branch_unlikely(&sched_user_acct))
+            account_user_exec_time(rq, p, delta_exec);
         /* --- END TASK 2B MODIFICATION --- */
 
         /*
@@ -1361,6 +2153,13 @@ update_stats_wait_end_fair(struct cfs_rq *cfs_rq, struct sched_entity *se)
 	if (entity_is_task(se))
 		p = task_of(se);
 
+	/* --- BEGIN TASK 2B: PER-USER WAIT LATENCY --- */
+	// Same delta as __update_stats_wait_end(); a migration only pauses the wait.
+	if (static_branch_unlikely(&sched_user_acct) && p && !task_on_rq_migrating(p))
+		user_wait_record(rq_of(cfs_rq), p,
+				 rq_clock(rq_of(cfs_rq)) - schedstat_val(stats->wait_start));
+	/* --- END TASK 2B MODIFICATION --- */
+
 	__update_stats_wait_end(rq_of(cfs_rq), p, stats);
 }
 
@@ -6860,6 +7659,175 @@ static void sched_fair_update_stop_tick(struct rq *rq, struct task_struct *p)
 }
 #endif
 
+#ifdef CONFIG_SCHED_AUTOGROUP
+/*
+ * Per-user CPU quotas.
+ *
+ * A user's quota is the CFS bandwidth of its task group (see
+ * user_group_fork()), set through tg_set_cfs_bandwidth() like cpu.max sets
+ * a cgroup's. Setting one creates the group if need be and moves the
+ * user's tasks into it even with sched_user_group off, so the user is
+ * throttled by the regular machinery: throttle_cfs_rq() once the group's
+ * cfs_rq on a CPU runs out of runtime, distribute_cfs_runtime() from the
+ * period timer, plus the slack and hotplug handling that come with them.
+ * Lifting the quota moves the tasks back out unless sched_user_group keeps
+ * them there. As for the groups, tasks in a cpu cgroup are not limited.
+ */
+extern int tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota, u64 burst);
+
+static DEFINE_MUTEX(user_bw_mutex);
+
+/* Put each task of @uid in the group user_group_task_group() now picks. */
+static void user_bw_move_tasks(kuid_t uid)
+{
+    struct task_struct *g, *p;
+
+    rcu_read_lock();
+    for_each_process_thread(g, p) {
+        if (uid_eq(task_uid(p), uid))
+            sched_move_task(p, true);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Set @uid's quota; @quota is RUNTIME_INF to lift it. Same limits as
+ * cpu.max, which tg_set_cfs_bandwidth() checks.
+ */
+static int user_bw_set(kuid_t uid, u64 quota, u64 period)
+{
+    struct user_accounting *ua;
+    struct task_group *tg;
+    unsigned long flags;
+    bool limited = quota != RUNTIME_INF;
+    int ret;
+
+    // user_stats_lock is taken from update_curr() with interrupts off
+    local_irq_save(flags);
+    ua = user_stats_get(uid);
+    local_irq_restore(flags);
+    if (!ua)
+        return -ENOSPC;
+
+    guard(mutex)(&user_bw_mutex);
+
+    if (!ua->has_quota && !limited)
+        return 0;
+
+    tg = user_group_get(ua);
+    if (!tg)
+        return -ENOMEM;
+
+    ret = tg_set_cfs_bandwidth(tg, period, quota, 0);
+    if (ret || ua->has_quota == limited)
+        return ret;
+
+    // Limit the group before moving the tasks in, unlimit it before moving them out
+    WRITE_ONCE(ua->has_quota, limited);
+    if (limited)
+        atomic_inc(&nr_user_bandwidth);
+    else
+        atomic_dec(&nr_user_bandwidth);
+    user_bw_move_tasks(uid);
+    return 0;
+}
+
+#ifdef CONFIG_PROC_FS
+/*
+ * /proc/sched_user_quota: "<uid> <quota us> <period us> <throttled>" per user
+ * with a quota, throttled being 1 while any CPU has the user's group
+ * throttled. Writing "<uid> <quota us> [<period us>]" sets a quota,
+ * "<uid> -1" lifts it.
+ */
+static int user_bw_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    guard(mutex)(&user_bw_mutex);
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        struct user_accounting *ua = &user_stats[i];
+        struct cfs_bandwidth *cfs_b;
+        u64 quota, period;
+        bool throttled;
+
+        if (!READ_ONCE(ua->is_active) || !ua->has_quota)
+            continue;
+
+        cfs_b = &ua->tg->cfs_bandwidth;
+        raw_spin_lock_irq(&cfs_b->lock);
+        quota = cfs_b->quota;
+        period = ktime_to_ns(cfs_b->period);
+        throttled = !list_empty(&cfs_b->throttled_cfs_rq);
+        raw_spin_unlock_irq(&cfs_b->lock);
+
+        seq_printf(m, "%u %llu %llu %d\n", __kuid_val(ua->uid),
+                   div_u64(quota, NSEC_PER_USEC), div_u64(period, NSEC_PER_USEC),
+                   throttled);
+    }
+    return 0;
+}
+
+static int user_bw_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, user_bw_show, NULL);
+}
+
+static ssize_t user_bw_write(struct file *file, const char __user *ubuf,
+                             size_t count, loff_t *ppos)
+{
+    char buf[64];
+    unsigned int uid;
+    long long quota_us;
+    unsigned long long period_us = div_u64(default_cfs_period(), NSEC_PER_USEC);
+    kuid_t kuid;
+    u64 quota;
+    int ret;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if (sscanf(buf, "%u %lld %llu", &uid, &quota_us, &period_us) < 2)
+        return -EINVAL;
+
+    kuid = make_kuid(current_user_ns(), uid);
+    if (!uid_valid(kuid) || __kuid_val(kuid) < 1000)
+        return -EINVAL;
+
+    if (quota_us < 0)
+        quota = RUNTIME_INF;
+    else if (quota_us > div_u64(U64_MAX, NSEC_PER_USEC))
+        return -EINVAL;
+    else
+        quota = (u64)quota_us * NSEC_PER_USEC;
+
+    if (period_us > div_u64(U64_MAX, NSEC_PER_USEC))
+        return -EINVAL;
+
+    ret = user_bw_set(kuid, quota, (u64)period_us * NSEC_PER_USEC);
+    return ret ? ret : count;
+}
+
+static const struct proc_ops user_bw_proc_ops = {
+    .proc_open      = user_bw_open,
+    .proc_read      = seq_read,
+    .proc_write     = user_bw_write,
+    .proc_lseek     = seq_lseek,
+    .proc_release   = single_release,
+};
+
+static int __init user_bw_proc_init(void)
+{
+    proc_create("sched_user_quota", 0644, NULL, &user_bw_proc_ops);
+    return 0;
+}
+late_initcall(user_bw_proc_init);
+#endif /* CONFIG_PROC_FS */
+#endif /* CONFIG_SCHED_AUTOGROUP */
+
 #else /* CONFIG_CFS_BANDWIDTH */
 
 static inline bool cfs_bandwidth_used(void)
@@ -9034,6 +10002,7 @@ again:
 	p = pick_task_fair(rq);
 	if (!p)
 		goto idle;
+
 	se = &p->se;
 
 #ifdef CONFIG_FAIR_GROUP_SCHED
@@ -9107,6 +10076,10 @@ idle:
 	 */
 	update_idle_rq_clock_pelt(rq);
 
+	/* No tick while idle, don't leave user time batched on this CPU */
+	if (static_branch_unlikely(&sched_user_acct))
+		user_stats_flush(rq);
+
 	return NULL;
 }
 
@@ -13271,6 +14244,12 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 	update_misfit_status(curr, rq);
 	check_update_overutilized_status(task_rq(curr));
 
+	if (static_branch_unlikely(&sched_user_acct)) {
+		user_stats_flush(rq);
+		user_stats_tick(rq, curr);
+		user_fair_refresh(rq);
+	}
+
 	task_tick_core(rq, curr);
 }
 
@@ -13890,3 +14869,7 @@ __init void init_sched_fair_class(void)
 #endif /* SMP */
 
 }
+
+#if IS_BUILTIN(CONFIG_KUNIT)
+#include "user_acct_test.c"
+#endif
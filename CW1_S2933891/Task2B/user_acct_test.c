@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the per-user accounting. #included at the end of fair.c,
+ * like ext4's mballoc-test.c, so the static helpers can be reached, and
+ * built whenever KUnit is built in. Run with
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=kernel/sched
+ *
+ * Every case works on its own table, lock and pending slot, never on
+ * user_stats or a CPU's user_pending: the live slots are never freed, so
+ * the tests must not take any.
+ */
+#include <kunit/test.h>
+#include <linux/kthread.h>
+
+#define USER_ACCT_TEST_UID 0x40000000
+#define USER_ACCT_TEST_NR_UIDS 16
+#define USER_ACCT_TEST_MAX_THREADS 16
+#define USER_ACCT_TEST_LOOPS 100000
+/* The batched fast path is a compare and an add; room for UML and debug kernels */
+#define USER_ACCT_TEST_MAX_NS 500
+
+struct user_acct_test_table {
+    struct user_accounting *slots;
+    spinlock_t lock;
+};
+
+static struct user_acct_test_table *user_acct_test_table(struct kunit *test)
+{
+    struct user_acct_test_table *t;
+
+    t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, t);
+    t->slots = kunit_kcalloc(test, MAX_TRACKED_USERS, sizeof(*t->slots), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, t->slots);
+    spin_lock_init(&t->lock);
+    return t;
+}
+
+/* The live lock is taken from update_curr() with interrupts off; do the same */
+static struct user_accounting *user_acct_test_get(struct user_acct_test_table *t, uid_t uid)
+{
+    struct user_accounting *ua;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    ua = __user_stats_get(t->slots, &t->lock, KUIDT_INIT(uid));
+    local_irq_restore(flags);
+    return ua;
+}
+
+static int user_acct_test_count(struct user_acct_test_table *t, uid_t uid)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++) {
+        if (READ_ONCE(t->slots[i].is_active) && __kuid_val(t->slots[i].uid) == uid)
+            n++;
+    }
+    return n;
+}
+
+static void user_acct_test_get_slot(struct kunit *test)
+{
+    struct user_acct_test_table *t = user_acct_test_table(test);
+    struct user_accounting *ua;
+
+    ua = user_acct_test_get(t, USER_ACCT_TEST_UID);
+    KUNIT_ASSERT_NOT_NULL(test, ua);
+    KUNIT_EXPECT_EQ(test, __kuid_val(ua->uid), USER_ACCT_TEST_UID);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&ua->total_exec_time), 0);
+    KUNIT_EXPECT_EQ(test, ua->fair_scale, (unsigned int)SCHED_FIXEDPOINT_SCALE);
+    KUNIT_EXPECT_PTR_EQ(test, user_acct_test_get(t, USER_ACCT_TEST_UID), ua);
+    KUNIT_EXPECT_PTR_EQ(test, __user_stats_find(t->slots, KUIDT_INIT(USER_ACCT_TEST_UID)), ua);
+    KUNIT_EXPECT_NULL(test, __user_stats_find(t->slots, KUIDT_INIT(USER_ACCT_TEST_UID + 1)));
+}
+
+struct user_acct_test_thread {
+    struct user_acct_test_table *table;
+    struct completion *start;
+    struct completion done;
+    int first;
+    struct user_accounting *got[USER_ACCT_TEST_NR_UIDS];
+};
+
+static int user_acct_test_thread_fn(void *data)
+{
+    struct user_acct_test_thread *t = data;
+    int i;
+
+    wait_for_completion(t->start);
+    // Every thread starts at another uid, so they race for different slots
+    for (i = 0; i < USER_ACCT_TEST_NR_UIDS; i++) {
+        int uid = (t->first + i) % USER_ACCT_TEST_NR_UIDS;
+
+        t->got[uid] = user_acct_test_get(t->table, USER_ACCT_TEST_UID + uid);
+    }
+    complete(&t->done);
+    return 0;
+}
+
+/* Racing inserts of the same uids end up with one slot per uid */
+static void user_acct_test_concurrent_insert(struct kunit *test)
+{
+    struct user_acct_test_table *table = user_acct_test_table(test);
+    struct user_acct_test_thread *threads;
+    DECLARE_COMPLETION_ONSTACK(start);
+    int nr = clamp(2 * num_online_cpus(), 4U, (unsigned int)USER_ACCT_TEST_MAX_THREADS);
+    int i, uid;
+
+    threads = kunit_kcalloc(test, nr, sizeof(*threads), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, threads);
+
+    for (i = 0; i < nr; i++) {
+        struct task_struct *k;
+
+        threads[i].table = table;
+        threads[i].start = &start;
+        threads[i].first = i;
+        init_completion(&threads[i].done);
+        k = kthread_run(user_acct_test_thread_fn, &threads[i], "user_acct_test/%d", i);
+        if (IS_ERR(k)) {
+            // Let the ones already running finish before failing
+            complete_all(&start);
+            while (i--)
+                wait_for_completion(&threads[i].done);
+            KUNIT_FAIL(test, "kthread_run: %ld", PTR_ERR(k));
+            return;
+        }
+    }
+
+    complete_all(&start);
+    for (i = 0; i < nr; i++)
+        wait_for_completion(&threads[i].done);
+
+    for (uid = 0; uid < USER_ACCT_TEST_NR_UIDS; uid++) {
+        KUNIT_EXPECT_EQ(test, user_acct_test_count(table, USER_ACCT_TEST_UID + uid), 1);
+        KUNIT_EXPECT_NOT_NULL(test, threads[0].got[uid]);
+        for (i = 1; i < nr; i++)
+            KUNIT_EXPECT_PTR_EQ(test, threads[i].got[uid], threads[0].got[uid]);
+    }
+}
+
+/* A full table turns new users away but still finds the ones it has */
+static void user_acct_test_table_full(struct kunit *test)
+{
+    struct user_acct_test_table *t = user_acct_test_table(test);
+    struct user_accounting *first;
+    int i;
+
+    for (i = 0; i < MAX_TRACKED_USERS; i++)
+        KUNIT_ASSERT_NOT_NULL(test, user_acct_test_get(t, USER_ACCT_TEST_UID + i));
+
+    first = __user_stats_find(t->slots, KUIDT_INIT(USER_ACCT_TEST_UID));
+    KUNIT_EXPECT_PTR_EQ(test, first, &t->slots[0]);
+    KUNIT_EXPECT_NULL(test, user_acct_test_get(t, USER_ACCT_TEST_UID + MAX_TRACKED_USERS));
+    KUNIT_EXPECT_PTR_EQ(test, user_acct_test_get(t, USER_ACCT_TEST_UID), first);
+}
+
+/*
+ * The batching fast path of account_user_exec_time(): time of the uid the
+ * pending slot batches for is added up, time of an untracked uid dropped,
+ * and any other uid is left for the slow path to flush and switch over.
+ */
+static void user_acct_test_batching(struct kunit *test)
+{
+    struct user_acct_test_table *t = user_acct_test_table(test);
+    struct user_pending pending = { .uid = KUIDT_INIT(USER_ACCT_TEST_UID) };
+
+    pending.ua = user_acct_test_get(t, USER_ACCT_TEST_UID);
+    KUNIT_ASSERT_NOT_NULL(test, pending.ua);
+
+    KUNIT_EXPECT_TRUE(test, user_pending_add(&pending, KUIDT_INIT(USER_ACCT_TEST_UID), 1000));
+    KUNIT_EXPECT_TRUE(test, user_pending_add(&pending, KUIDT_INIT(USER_ACCT_TEST_UID), 1000));
+    KUNIT_EXPECT_EQ(test, pending.delta_exec, 2000);
+    // Nothing reaches the table before the flush
+    KUNIT_EXPECT_EQ(test, atomic64_read(&pending.ua->total_exec_time), 0);
+
+    KUNIT_EXPECT_FALSE(test, user_pending_add(&pending, KUIDT_INIT(USER_ACCT_TEST_UID + 1), 500));
+    KUNIT_EXPECT_EQ(test, pending.delta_exec, 2000);
+
+    // System users (< 1000) get no slot, and their time is dropped
+    pending = (struct user_pending){ .uid = GLOBAL_ROOT_UID };
+    KUNIT_EXPECT_TRUE(test, user_pending_add(&pending, GLOBAL_ROOT_UID, 500));
+    KUNIT_EXPECT_EQ(test, pending.delta_exec, 0);
+}
+
+/* Per-call cost of the batched path update_curr() takes */
+static void user_acct_test_hot_path_cost(struct kunit *test)
+{
+    struct user_acct_test_table *t = user_acct_test_table(test);
+    struct user_pending *pending;
+    unsigned int batched = 0;
+    u64 start, per_call;
+    int i;
+
+    // Off the stack, so the barrier() keeps the loop from being folded
+    pending = kunit_kzalloc(test, sizeof(*pending), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, pending);
+    pending->uid = KUIDT_INIT(USER_ACCT_TEST_UID);
+    pending->ua = user_acct_test_get(t, USER_ACCT_TEST_UID);
+    KUNIT_ASSERT_NOT_NULL(test, pending->ua);
+
+    preempt_disable();
+    start = ktime_get_ns();
+    for (i = 0; i < USER_ACCT_TEST_LOOPS; i++) {
+        batched += user_pending_add(pending, KUIDT_INIT(USER_ACCT_TEST_UID), 1);
+        barrier();
+    }
+    per_call = div_u64(ktime_get_ns() - start, USER_ACCT_TEST_LOOPS);
+    preempt_enable();
+
+    kunit_info(test, "user_pending_add(): %llu ns per call\n", per_call);
+    KUNIT_EXPECT_EQ(test, batched, (unsigned int)USER_ACCT_TEST_LOOPS);
+    KUNIT_EXPECT_EQ(test, pending->delta_exec, USER_ACCT_TEST_LOOPS);
+    KUNIT_EXPECT_LT(test, per_call, (u64)USER_ACCT_TEST_MAX_NS);
+}
+
+static struct kunit_case user_acct_test_cases[] = {
+    KUNIT_CASE(user_acct_test_get_slot),
+    KUNIT_CASE(user_acct_test_concurrent_insert),
+    KUNIT_CASE(user_acct_test_table_full),
+    KUNIT_CASE(user_acct_test_batching),
+    KUNIT_CASE(user_acct_test_hot_path_cost),
+    {}
+};
+
+static struct kunit_suite user_acct_test_suite = {
+    .name = "sched_user_acct",
+    .test_cases = user_acct_test_cases,
+};
+
+kunit_test_suite(user_acct_test_suite);